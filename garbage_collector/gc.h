@@ -0,0 +1,77 @@
+#ifndef GC_H
+#define GC_H
+
+// The collector's interface, for programs that are built with
+// mark_and_sweep.c. See there for what each function does.
+
+#include <stddef.h>
+
+// Where the pointers are in a block from gc_malloc_typed()
+typedef struct gc_layout gc_layout_t;
+
+/*
+ * What the collector has been doing, from gc_stats() or the trace hook.
+ * Times are in milliseconds.
+ */
+typedef struct gc_stats {
+    // The last collection
+    double mark_ms;  // with the world stopped
+    double sweep_ms;  // however the sweep was spread out
+    double pause_ms;  // the whole of gc_collect(), or both concurrent pauses
+    double concurrent_ms;  // marking while the program ran
+    double remark_ms;  // the final pause of a concurrent collection
+    size_t root_bytes;  // roots scanned
+    size_t heap_bytes_scanned;  // blocks scanned
+    size_t live_bytes, live_blocks;  // blocks that survived
+    size_t freed_bytes, freed_blocks;  // blocks that were freed
+
+    // The last minor collection, in generational mode
+    double minor_pause_ms;
+    size_t minor_scanned_bytes;  // roots, dirty cards and young blocks
+    size_t promoted_bytes, promoted_blocks;  // young blocks that survived
+
+    // The heap as it is now
+    size_t heap_bytes;  // mapped for the heap
+    size_t free_bytes, free_blocks;  // on the free list
+    size_t largest_free;  // largest block on the free list
+    double fragmentation;  // 1 - largest_free / free_bytes
+
+    // Automatic collection
+    size_t allocated_bytes;  // handed out since the last collection
+    size_t trigger_bytes;  // allocated_bytes that start the next one
+
+    // Since the start
+    unsigned long collections;
+    unsigned long minor_collections;
+    unsigned long more_core_calls;
+    double pause_p50_ms, pause_p99_ms, pause_max_ms;
+} gc_stats_t;
+
+typedef void (*gc_trace_fn)(const gc_stats_t *stats, void *arg);
+
+// Allocation
+void *gc_malloc(size_t alloc_size);
+void *gc_malloc_atomic(size_t alloc_size);
+void *gc_malloc_typed(size_t alloc_size, const gc_layout_t *layout);
+void *gc_realloc(void *p, size_t alloc_size);
+gc_layout_t *gc_make_layout(const unsigned long *bitmap, size_t num_words);
+void gc_write_barrier(void *obj, void **field, void *value);
+
+// Collection
+void gc_collect(void);
+void gc_register_thread(void);
+void gc_unregister_thread(void);
+
+// Tuning
+void gc_set_lazy_sweep(int enabled);
+void gc_set_mark_threads(int n);
+void gc_set_gc_percent(int percent);
+void gc_set_heap_growth(int percent);
+void gc_set_generational(int enabled);
+void gc_set_concurrent(int enabled);
+
+// Statistics
+void gc_stats(gc_stats_t *out);
+void gc_set_trace(gc_trace_fn fn, void *arg);
+
+#endif
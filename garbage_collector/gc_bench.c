@@ -0,0 +1,430 @@
+/*** includes ***/
+
+// The benchmarks are built with the collector's source rather than against
+// gc.h, leaving out its demo main()
+#define GC_NO_MAIN
+#include "mark_and_sweep.c"
+
+#include <malloc.h>
+
+/*** defines, structs ***/
+
+#define RING_SIZE 4096  // live objects kept by the allocation benchmarks
+#define CHURN_SLOTS 65536  // live objects kept by the fragmentation benchmark
+#define PAUSE_RUNS 5  // collections timed for every object graph
+
+typedef struct node {
+    struct node *left;
+    struct node *right;
+    long value;
+} node_t;
+
+// Sizes requested by an allocation benchmark, in bytes
+typedef struct dist {
+    const char *name;
+    size_t min_size, max_size;
+} dist_t;
+
+static const dist_t dists[] = {
+    {"small", 16, 16},
+    {"mixed", 8, 256},
+    {"large", 1024, 16384},
+};
+
+#define NUM_DISTS (sizeof(dists) / sizeof(dists[0]))
+
+// Object graphs for the pause benchmark
+enum shape { LIST, TREE, GRAPH };
+static const char *shape_names[] = {"list", "tree", "graph"};
+
+#define NUM_SHAPES (sizeof(shape_names) / sizeof(shape_names[0]))
+
+/*** data ***/
+
+// Everything the benchmarks keep alive hangs off these, which the collector
+// scans as part of the data segment
+static void *ring[RING_SIZE];
+static void *slots[CHURN_SLOTS];
+static node_t *root;
+static node_t **table;
+
+static int json = 0;  // output format, CSV otherwise
+static int num_results = 0;
+static double scale = 1;  // multiplies every operation and object count
+static unsigned long rng_state = 88172645463325252UL;
+
+/*** output ***/
+
+/*
+ * Print one measurement. Every line is a single number, so that a script
+ * can compare the output of two builds row by row.
+ */
+static void result(const char *bench, const char *allocator,
+                   const char *name, size_t n, const char *metric,
+                   double value)
+{
+    if (json)
+        printf("%s\n  {\"bench\": \"%s\", \"allocator\": \"%s\", "
+               "\"case\": \"%s\", \"n\": %zu, \"metric\": \"%s\", "
+               "\"value\": %.10g}",
+               num_results == 0 ? "[" : ",", bench, allocator, name, n,
+               metric, value);
+    else {
+        if (num_results == 0)
+            printf("bench,allocator,case,n,metric,value\n");
+        printf("%s,%s,%s,%zu,%s,%.10g\n", bench, allocator, name, n, metric,
+               value);
+    }
+    num_results++;
+}
+
+static void end_results(void)
+{
+    if (json)
+        printf("%s]\n", num_results == 0 ? "[" : "\n");
+}
+
+/*** helpers ***/
+
+// xorshift64, so every run asks for the same sizes in the same order
+static unsigned long rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static size_t pick_size(const dist_t *d)
+{
+    return d->min_size + rng() % (d->max_size - d->min_size + 1);
+}
+
+static size_t scaled(size_t n)
+{
+    return (size_t) (n * scale) > 0 ? (size_t) (n * scale) : 1;
+}
+
+/*
+ * Collect until nothing from an earlier benchmark is left to free, so that
+ * it doesn't count against the next one.
+ */
+static void reset_heap(void)
+{
+    memset(ring, 0, sizeof(ring));
+    memset(slots, 0, sizeof(slots));
+    root = NULL;
+    table = NULL;
+    gc_collect();
+    gc_collect();
+}
+
+/*** allocation ***/
+
+/*
+ * Replace random objects of a ring of live ones num_ops times, with
+ * gc_malloc() and its automatic collections, then with malloc() and free().
+ */
+static void bench_alloc(const dist_t *d, size_t num_ops)
+{
+    gc_stats_t before, after;
+    double start, ms;
+    size_t i, j;
+    char *p;
+
+    reset_heap();
+    gc_stats(&before);
+    start = now_ms();
+    for (i = 0; i < num_ops; i++) {
+        j = rng() % RING_SIZE;
+        p = gc_malloc(pick_size(d));
+        if (p == NULL) {
+            fprintf(stderr, "gc_bench: gc_malloc failed\n");
+            exit(1);
+        }
+        p[0] = 1;
+        ring[j] = p;
+    }
+    ms = now_ms() - start;
+    gc_stats(&after);
+    result("alloc", "gc", d->name, num_ops, "ops_per_sec",
+           num_ops / ms * 1000);
+    result("alloc", "gc", d->name, num_ops, "collections",
+           after.collections - before.collections +
+           after.minor_collections - before.minor_collections);
+    result("alloc", "gc", d->name, num_ops, "pause_max_ms",
+           after.pause_max_ms);
+
+    memset(ring, 0, sizeof(ring));
+    start = now_ms();
+    for (i = 0; i < num_ops; i++) {
+        j = rng() % RING_SIZE;
+        free(ring[j]);
+        p = malloc(pick_size(d));
+        if (p == NULL) {
+            fprintf(stderr, "gc_bench: malloc failed\n");
+            exit(1);
+        }
+        p[0] = 1;
+        ring[j] = p;
+    }
+    ms = now_ms() - start;
+    result("alloc", "malloc", d->name, num_ops, "ops_per_sec",
+           num_ops / ms * 1000);
+    for (j = 0; j < RING_SIZE; j++)
+        free(ring[j]);
+    memset(ring, 0, sizeof(ring));
+}
+
+/*** pauses ***/
+
+static node_t *new_node(long value)
+{
+    node_t *n = gc_malloc(sizeof(node_t));
+
+    if (n == NULL) {
+        fprintf(stderr, "gc_bench: gc_malloc failed\n");
+        exit(1);
+    }
+    n->value = value;
+    return n;
+}
+
+/*
+ * Pointer stores between heap blocks go through the write barrier, which
+ * generational and concurrent modes depend on.
+ */
+static void set_field(node_t *from, node_t **field, node_t *to)
+{
+    gc_write_barrier(from, (void **) field, to);
+}
+
+static node_t *build_tree(size_t n, long *next)
+{
+    node_t *t;
+    size_t left;
+
+    if (n == 0)
+        return NULL;
+    t = new_node((*next)++);
+    left = (n - 1) / 2;
+    set_field(t, &t->left, build_tree(left, next));
+    set_field(t, &t->right, build_tree(n - 1 - left, next));
+    return t;
+}
+
+/*
+ * Build n nodes shaped as a linked list, a balanced binary tree or a random
+ * graph of out-degree two, reachable from root.
+ */
+static void build_shape(enum shape shape, size_t n)
+{
+    node_t *t;
+    long next = 0;
+    size_t i;
+
+    switch (shape) {
+    case LIST:
+        root = NULL;
+        for (i = 0; i < n; i++) {
+            t = new_node(i);
+            set_field(t, &t->left, root);
+            root = t;
+        }
+        break;
+    case TREE:
+        root = build_tree(n, &next);
+        break;
+    case GRAPH:
+        // Most nodes are reachable from the first one once the table that
+        // holds them all is let go
+        table = gc_malloc(n * sizeof(node_t *));
+        if (table == NULL) {
+            fprintf(stderr, "gc_bench: gc_malloc failed\n");
+            exit(1);
+        }
+        for (i = 0; i < n; i++)
+            set_field((node_t *) table, &table[i], new_node(i));
+        for (i = 0; i < n; i++) {
+            set_field(table[i], &table[i]->left, table[rng() % n]);
+            set_field(table[i], &table[i]->right, table[rng() % n]);
+        }
+        root = table[0];
+        table = NULL;
+        break;
+    }
+}
+
+/*
+ * Time gc_collect() with the live set made of n nodes of a given shape. The
+ * first collection frees what the build left behind and isn't counted.
+ */
+static void bench_pause(enum shape shape, size_t n)
+{
+    const char *name = shape_names[shape];
+    double pause = 0, mark = 0, sweep = 0, max = 0;
+    gc_stats_t st;
+    int i;
+
+    reset_heap();
+    build_shape(shape, n);
+    gc_collect();
+    for (i = 0; i < PAUSE_RUNS; i++) {
+        gc_collect();
+        gc_stats(&st);
+        pause += st.pause_ms;
+        mark += st.mark_ms + st.remark_ms;
+        sweep += st.sweep_ms;
+        if (st.pause_ms > max)
+            max = st.pause_ms;
+    }
+    result("pause", "gc", name, n, "pause_ms", pause / PAUSE_RUNS);
+    result("pause", "gc", name, n, "pause_max_ms", max);
+    result("pause", "gc", name, n, "mark_ms", mark / PAUSE_RUNS);
+    result("pause", "gc", name, n, "sweep_ms", sweep / PAUSE_RUNS);
+    result("pause", "gc", name, n, "live_bytes", st.live_bytes);
+    result("pause", "gc", name, n, "ns_per_live_kb",
+           st.live_bytes == 0 ? 0 :
+           pause / PAUSE_RUNS * 1e6 / (st.live_bytes / 1024.0));
+}
+
+/*** fragmentation ***/
+
+/*
+ * Keep CHURN_SLOTS objects of random sizes alive while replacing num_ops of
+ * them, then look at how scattered the free memory is. With malloc() the
+ * same is measured through mallinfo2(), where glibc has it.
+ */
+static void bench_frag(size_t num_ops)
+{
+    static const dist_t churn = {"churn", 16, 4096};
+    gc_stats_t st;
+    double start, ms;
+    size_t i, j;
+
+    reset_heap();
+    start = now_ms();
+    for (i = 0; i < CHURN_SLOTS + num_ops; i++) {
+        j = i < CHURN_SLOTS ? i : rng() % CHURN_SLOTS;
+        slots[j] = gc_malloc(pick_size(&churn));
+    }
+    ms = now_ms() - start;
+    gc_collect();
+    gc_stats(&st);
+    result("frag", "gc", churn.name, num_ops, "ms", ms);
+    result("frag", "gc", churn.name, num_ops, "heap_bytes", st.heap_bytes);
+    result("frag", "gc", churn.name, num_ops, "live_bytes", st.live_bytes);
+    result("frag", "gc", churn.name, num_ops, "free_bytes", st.free_bytes);
+    result("frag", "gc", churn.name, num_ops, "free_blocks", st.free_blocks);
+    result("frag", "gc", churn.name, num_ops, "largest_free",
+           st.largest_free);
+    result("frag", "gc", churn.name, num_ops, "fragmentation",
+           st.fragmentation);
+    memset(slots, 0, sizeof(slots));
+
+    start = now_ms();
+    for (i = 0; i < CHURN_SLOTS + num_ops; i++) {
+        j = i < CHURN_SLOTS ? i : rng() % CHURN_SLOTS;
+        if (i >= CHURN_SLOTS)
+            free(slots[j]);
+        slots[j] = malloc(pick_size(&churn));
+    }
+    ms = now_ms() - start;
+    result("frag", "malloc", churn.name, num_ops, "ms", ms);
+#if defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    {
+        struct mallinfo2 mi = mallinfo2();
+
+        result("frag", "malloc", churn.name, num_ops, "heap_bytes",
+               mi.arena + mi.hblkhd);
+        result("frag", "malloc", churn.name, num_ops, "live_bytes",
+               mi.uordblks + mi.hblkhd);
+        result("frag", "malloc", churn.name, num_ops, "free_bytes",
+               mi.fordblks);
+        result("frag", "malloc", churn.name, num_ops, "free_blocks",
+               mi.ordblks);
+    }
+#endif
+    for (j = 0; j < CHURN_SLOTS; j++)
+        free(slots[j]);
+    memset(slots, 0, sizeof(slots));
+}
+
+/*** main ***/
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: gc_bench [-j] [-s scale] [-l] [-g] [-c] [-t threads] "
+            "[alloc|pause|frag ...]\n"
+            "  -j  print JSON instead of CSV\n"
+            "  -s  multiply every count by scale\n"
+            "  -l  lazy sweep\n"
+            "  -g  generational mode\n"
+            "  -c  concurrent mark\n"
+            "  -t  marking threads\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    static const size_t pause_sizes[] = {10000, 100000, 1000000};
+    int run_alloc = 0, run_pause = 0, run_frag = 0;
+    size_t i, j;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "js:lgct:")) != -1) {
+        switch (opt) {
+        case 'j':
+            json = 1;
+            break;
+        case 's':
+            scale = atof(optarg);
+            if (scale <= 0)
+                usage();
+            break;
+        case 'l':
+            gc_set_lazy_sweep(1);
+            break;
+        case 'g':
+            gc_set_generational(1);
+            break;
+        case 'c':
+            gc_set_concurrent(1);
+            break;
+        case 't':
+            gc_set_mark_threads(atoi(optarg));
+            break;
+        default:
+            usage();
+        }
+    }
+    for (; optind < argc; optind++) {
+        if (strcmp(argv[optind], "alloc") == 0)
+            run_alloc = 1;
+        else if (strcmp(argv[optind], "pause") == 0)
+            run_pause = 1;
+        else if (strcmp(argv[optind], "frag") == 0)
+            run_frag = 1;
+        else
+            usage();
+    }
+    if (!run_alloc && !run_pause && !run_frag)
+        run_alloc = run_pause = run_frag = 1;
+
+    gc_register_thread();
+
+    if (run_alloc)
+        for (i = 0; i < NUM_DISTS; i++)
+            bench_alloc(&dists[i], scaled(2000000));
+    if (run_pause)
+        for (i = 0; i < NUM_SHAPES; i++)
+            for (j = 0; j < sizeof(pause_sizes) / sizeof(pause_sizes[0]); j++)
+                bench_pause(i, scaled(pause_sizes[j]));
+    if (run_frag)
+        bench_frag(scaled(1000000));
+    end_results();
+
+    return 0;
+}
@@ -1,195 +1,2284 @@
 /*** includes ***/
 
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 
-/*** defines, structs ***/
+#include "gc.h"
+
+/*** defines, structs ***/
+
+#define MIN_ALLOC_SIZE 4096  // page-sized chunk
+
+// Block flags
+#define BLOCK_PAGE 0x1  // page carved into slots of a single size class
+#define BLOCK_USED 0x2  // small slot that is allocated
+#define BLOCK_YOUNG 0x4  // block in the nursery, see gc_set_generational()
+#define BLOCK_ATOMIC 0x8  // holds no pointers, see gc_malloc_atomic()
+#define BLOCK_TYPED 0x10  // next points to its layout, see gc_malloc_typed()
+
+typedef struct header {
+    unsigned int size;
+    unsigned int flags;  // fits in what would otherwise be padding
+    struct header *next;
+} header_t;
+
+/*
+ * Where the pointers are in a block from gc_malloc_typed(). Word i of the
+ * block may hold a pointer if bit i % num_words of bitmap is set, so a block
+ * longer than the layout repeats it, like an array of structs.
+ */
+struct gc_layout {
+    size_t num_words;
+    unsigned long bitmap[];
+};
+
+/*
+ * Small objects are served from pages of fixed-size slots. A page is an
+ * ordinary used block taken from the free list, and each slot in it keeps a
+ * header_t so that slots and large blocks are marked the same way.
+ */
+typedef struct page {
+    header_t hdr;
+    struct page *next_page;  // next page of the same class with free slots
+    header_t *free;  // free slots in this page
+    header_t *bump;  // slots from here to the end haven't been handed out yet
+    unsigned int cls;  // size class
+    unsigned int live;  // slots found live by the last sweep
+} page_t;
+
+#define PAGE_UNITS (MIN_ALLOC_SIZE / sizeof(header_t))
+#define PAGE_HEADER_UNITS ((sizeof(page_t) + sizeof(header_t) - 1) / \
+                           sizeof(header_t))
+
+// Slot sizes in units, header included. Requests above the largest class go
+// to the free list.
+static const unsigned int class_units[] = {2, 3, 4, 5, 6, 7, 8, 9, 13, 17};
+
+#define NUM_CLASSES (sizeof(class_units) / sizeof(class_units[0]))
+#define SMALL_MAX_UNITS 17
+
+// Number of block index entries a lazy sweep step looks at
+#define LAZY_SWEEP_STEP 8
+
+/*
+ * The heap is made of chunks mapped by more_core(), each CHUNK_SIZE bytes or
+ * a multiple of it for the largest blocks, and aligned to CHUNK_SIZE. A chunk
+ * starts with a descriptor, two bitmaps and a card table, followed by the
+ * heap space itself. Mark bits live here rather than in the block headers,
+ * so marking never writes to the blocks and clearing every mark is a memset.
+ * The start bits locate the pages and large blocks, so that a candidate
+ * pointer is resolved without a search of the whole heap.
+ */
+typedef struct chunk {
+    struct chunk *next;  // next chunk in chunk_list
+    size_t map_size;  // bytes mapped for the chunk, descriptor included
+    header_t *start, *end;  // heap space of the chunk
+    unsigned long *marks;  // one bit per header_t-sized unit of heap space
+    unsigned long *starts;  // set where a page or large block starts
+    size_t num_words;  // length of marks and of starts
+    unsigned char *cards;  // one byte per CARD_SIZE bytes of heap space
+    size_t num_cards;
+} chunk_t;
+
+#define BITS_PER_WORD (8 * sizeof(unsigned long))
+
+#define CHUNK_SHIFT 21
+#define CHUNK_SIZE (1UL << CHUNK_SHIFT)  // 2MB, the size of a huge page
+
+// Set to 1 to ask for transparent huge pages for the heap chunks
+#define USE_HUGE_PAGES 0
+
+// Bytes of heap space covered by a card, which gc_write_barrier() marks
+// dirty when a pointer is stored in an old block
+#define CARD_SIZE 512
+
+// In generational mode, small blocks are allocated in the nursery, which
+// threads take from the free list a piece at a time. A minor collection runs
+// once NURSERY_SIZE bytes of it have been handed out.
+#define NURSERY_SIZE (2UL << 20)
+#define TLAB_UNITS 2048  // nursery space a thread asks for, 32KB
+
+/*
+ * A piece of the nursery taken by a thread. Once the thread is done with it,
+ * it's covered by the young blocks allocated in it, one after the other, and
+ * a filler block for whatever was left at the end.
+ */
+typedef struct tlab {
+    header_t *start, *end;
+} tlab_t;
+
+// The chunk map resolves the slices of a 48-bit address space in two levels
+#define ADDRESS_BITS 48
+#define MAP_LEAF_BITS 13
+#define MAP_ROOT_BITS (ADDRESS_BITS - CHUNK_SHIFT - MAP_LEAF_BITS)
+
+#define MAX_MARK_THREADS 64
+#define DEQUE_SIZE (1 << 20)  // entries in a marker's deque, a power of two
+#define ROOT_PIECE_WORDS 4096  // root ranges are shared out in pieces this long
+
+/*
+ * A thread taking part in the mark phase. Its Chase-Lev work-stealing deque
+ * holds grey blocks, blocks that are marked but whose contents haven't been
+ * scanned yet. The owner pushes and takes at the bottom, while markers that
+ * run out of work steal from the top.
+ */
+typedef struct marker {
+    _Atomic long top, bottom;
+    _Atomic(header_t *) *buf;  // DEQUE_SIZE entries
+    pthread_t id;
+    sem_t go;  // posted to start a helper on a mark phase
+    size_t root_bytes, heap_bytes;  // scanned by this marker
+} marker_t;
+
+typedef struct range {
+    long *start, *end;
+} range_t;
+
+// Blocks a thread shades in gc_write_barrier() during a concurrent mark,
+// before it hands them to the marker
+#define SATB_SIZE 256
+
+#define GC_SIG_SUSPEND SIGPWR  // stops a thread for a collection
+#define GC_SIG_RESUME SIGXCPU  // lets it go again
+
+/*
+ * Every thread that allocates is registered. A thread allocates small
+ * objects from pages of its own that no other thread touches, so the common
+ * case takes no lock. Everything else is protected by heap_lock.
+ */
+typedef struct gc_thread {
+    pthread_t id;
+    long *stack_bottom;  // highest address of the thread's stack
+    long *stack_top;  // lowest address in use, while the thread is stopped
+    page_t *pages[NUM_CLASSES];  // pages the thread allocates from
+    header_t *tlab, *tlab_end;  // nursery space the thread allocates from
+    header_t *satb[SATB_SIZE];  // see satb_log()
+    unsigned int satb_len;
+    volatile sig_atomic_t in_alloc;  // in the lock-free allocation path
+    volatile sig_atomic_t stop_pending;  // asked to stop while in_alloc
+    int stopped;  // the collector has stopped this thread
+    struct gc_thread *next;
+} gc_thread_t;
+
+#define PAUSE_BUCKETS 128
+
+/*** prototypes ***/
+
+static int sweep_blocks(size_t budget);
+static void collect(int if_due);
+static void minor_collect(void);
+
+/*** header operations ***/
+
+static header_t base = {0, 0, &base};  // zero sized block to start with
+static header_t *freep = &base;  // pointer to the first free block of memory
+static page_t *bins[NUM_CLASSES];  // pages with free slots, per size class
+
+/*** metadata ***/
+
+/*
+ * Allocate or resize memory for the collector's own tables. These come
+ * straight from mmap rather than from libc malloc, since a collection may
+ * need to grow them while another thread is stopped inside malloc holding
+ * its lock. The memory is zeroed.
+ */
+static void *meta_realloc(void *p, size_t old_size, size_t new_size)
+{
+    void *new;
+
+    if (p == NULL)
+        new = mmap(NULL, new_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    else
+        new = mremap(p, old_size, new_size, MREMAP_MAYMOVE);
+    return new == MAP_FAILED ? NULL : new;
+}
+
+/*** heap policy ***/
+
+#define MIN_TRIGGER (4UL << 20)  // least allocated between two collections
+#define MAX_GROWTH_CHUNKS 64  // most chunks more_core() maps at once
+
+static int gc_percent = 100;  // see gc_set_gc_percent()
+static int heap_growth = 50;  // see gc_set_heap_growth()
+static size_t allocated = 0;  // bytes handed out since the last collection
+static size_t trigger = MIN_TRIGGER;  // allocated that starts a collection
+static size_t heap_goal = 2 * MIN_TRIGGER;  // heap size the trigger aims at
+static int marking = 0;  // a concurrent mark is under way
+
+static int collection_due(void)
+{
+    return gc_percent >= 0 && allocated >= trigger && !marking;
+}
+
+/*** stats ***/
+
+static gc_stats_t stats;  // filled in as the collections go
+static unsigned long pause_hist[PAUSE_BUCKETS];  // see pause_bucket()
+static gc_trace_fn trace_fn = NULL;
+static void *trace_arg;
+static int collecting = 0;  // within gc_collect(), which reports itself
+
+static double now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/*
+ * Find the histogram bucket of a pause of us microseconds. Above 4us the
+ * buckets are a quarter of a power of two wide.
+ */
+static int pause_bucket(unsigned long us)
+{
+    int b;
+
+    if (us < 4)
+        return us;
+    b = BITS_PER_WORD - 1 - __builtin_clzl(us);
+    b = 4 * (b - 1) + ((us >> (b - 2)) & 3);
+    return b < PAUSE_BUCKETS ? b : PAUSE_BUCKETS - 1;
+}
+
+/*
+ * Return the pause time, in milliseconds, that a fraction p of the pauses
+ * so far didn't exceed. This is the upper bound of the bucket it falls in.
+ */
+static double pause_percentile(double p)
+{
+    unsigned long total = 0, seen = 0;
+    double upper;
+    int b;
+
+    for (b = 0; b < PAUSE_BUCKETS; b++)
+        total += pause_hist[b];
+    for (b = 0; b < PAUSE_BUCKETS; b++)
+        if ((seen += pause_hist[b]) > 0 && seen >= p * total)
+            break;
+    if (b == PAUSE_BUCKETS)
+        return 0;
+
+    upper = b < 4 ? b + 1 : (double) ((5UL + b % 4) << (b / 4 - 1));
+    upper /= 1e3;
+    return upper < stats.pause_max_ms ? upper : stats.pause_max_ms;
+}
+
+static void record_pause(double ms)
+{
+    if (ms > stats.pause_max_ms)
+        stats.pause_max_ms = ms;
+    pause_hist[pause_bucket(ms * 1e3)]++;
+}
+
+/*
+ * Fill in the figures of stats that describe the heap as it is now.
+ */
+static void update_heap_stats(void)
+{
+    header_t *p;
+
+    stats.free_bytes = stats.free_blocks = stats.largest_free = 0;
+    for (p = base.next; p != &base; p = p->next) {
+        stats.free_blocks++;
+        stats.free_bytes += p->size * sizeof(header_t);
+        if (p->size * sizeof(header_t) > stats.largest_free)
+            stats.largest_free = p->size * sizeof(header_t);
+    }
+    stats.fragmentation = stats.free_bytes == 0 ? 0 :
+        1 - (double) stats.largest_free / stats.free_bytes;
+
+    stats.allocated_bytes = allocated;
+    stats.pause_p50_ms = pause_percentile(0.5);
+    stats.pause_p99_ms = pause_percentile(0.99);
+}
+
+/*
+ * A collection is over once both gc_collect() and its sweep are done.
+ */
+static void end_collection(void)
+{
+    if (trace_fn == NULL)
+        return;
+    update_heap_stats();
+    trace_fn(&stats, trace_arg);
+}
+
+/*** chunks ***/
+
+static chunk_t *chunk_list = NULL;  // every chunk, most recently mapped first
+
+// Maps every CHUNK_SIZE-aligned slice of the address space to the chunk that
+// covers it, if any. The leaves are allocated as they're first needed.
+static chunk_t ***chunk_map = NULL;
+
+/*
+ * Point the chunk map entries for every slice of a chunk at value. Returns -1
+ * if the chunk can't be mapped.
+ */
+static int map_chunk(chunk_t *cp, chunk_t *value)
+{
+    unsigned long a = (unsigned long) cp >> CHUNK_SHIFT;
+    unsigned long last = ((unsigned long) cp + cp->map_size - 1) >> CHUNK_SHIFT;
+    chunk_t ***leaf;
+
+    if (last >> (MAP_ROOT_BITS + MAP_LEAF_BITS))
+        return -1;
+    if (chunk_map == NULL &&
+        (chunk_map = meta_realloc(NULL, 0, sizeof(chunk_t **) << MAP_ROOT_BITS))
+            == NULL)
+        return -1;
+    for (; a <= last; a++) {
+        leaf = &chunk_map[a >> MAP_LEAF_BITS];
+        if (*leaf == NULL &&
+            (*leaf = meta_realloc(NULL, 0, sizeof(chunk_t *) << MAP_LEAF_BITS))
+                == NULL)
+            return -1;
+        (*leaf)[a & ((1UL << MAP_LEAF_BITS) - 1)] = value;
+    }
+    return 0;
+}
+
+/*
+ * Find the chunk that covers the address p, or NULL if p isn't in the heap.
+ */
+static chunk_t *find_chunk(const void *p)
+{
+    unsigned long a = (unsigned long) p >> CHUNK_SHIFT;
+    chunk_t **leaf;
+
+    if (chunk_map == NULL || a >> (MAP_ROOT_BITS + MAP_LEAF_BITS))
+        return NULL;
+    if ((leaf = chunk_map[a >> MAP_LEAF_BITS]) == NULL)
+        return NULL;
+    return leaf[a & ((1UL << MAP_LEAF_BITS) - 1)];
+}
+
+static int is_marked(header_t *bp)
+{
+    chunk_t *cp = find_chunk(bp);
+    size_t bit = bp - cp->start;
+
+    return (cp->marks[bit / BITS_PER_WORD] >> (bit % BITS_PER_WORD)) & 1;
+}
+
+/*
+ * Mark a block. Returns whether it was marked already. Markers race for the
+ * same words, so the bit is set atomically, and only once it's been seen
+ * clear, since most blocks are reached more than once.
+ */
+static int test_and_set_mark(header_t *bp)
+{
+    chunk_t *cp = find_chunk(bp);
+    size_t bit = bp - cp->start;
+    unsigned long mask = 1UL << (bit % BITS_PER_WORD);
+    _Atomic unsigned long *word =
+        (_Atomic unsigned long *) &cp->marks[bit / BITS_PER_WORD];
+
+    if (atomic_load_explicit(word, memory_order_relaxed) & mask)
+        return 1;
+    return (atomic_fetch_or_explicit(word, mask, memory_order_relaxed) &
+            mask) != 0;
+}
+
+static void clear_marks(void)
+{
+    chunk_t *cp;
+
+    for (cp = chunk_list; cp != NULL; cp = cp->next)
+        memset(cp->marks, 0, cp->num_words * sizeof(unsigned long));
+}
+
+static void clear_cards(void)
+{
+    chunk_t *cp;
+
+    for (cp = chunk_list; cp != NULL; cp = cp->next)
+        memset(cp->cards, 0, cp->num_cards);
+}
+
+/*
+ * Set or clear the start bit of a page or large block. Threads set the bits
+ * of their young blocks without taking the heap lock, and nursery space
+ * taken by different threads may share a word, so the update is atomic.
+ */
+static void set_start(header_t *bp, int on)
+{
+    chunk_t *cp = find_chunk(bp);
+    size_t bit = bp - cp->start;
+    unsigned long mask = 1UL << (bit % BITS_PER_WORD);
+    _Atomic unsigned long *word =
+        (_Atomic unsigned long *) &cp->starts[bit / BITS_PER_WORD];
+
+    if (on)
+        atomic_fetch_or_explicit(word, mask, memory_order_relaxed);
+    else
+        atomic_fetch_and_explicit(word, ~mask, memory_order_relaxed);
+}
+
+/*** block index ***/
+
+// Every page and large block, for the sweep to walk. Each of them also has
+// its start bit set. The index is sorted by address before a collection, so
+// that the sweep frees blocks in address order and add_to_free_list() finds
+// their place on the free list right away.
+static header_t **blocks = NULL;
+static size_t num_blocks = 0;
+static size_t max_blocks = 0;
+static int blocks_sorted = 1;  // cleared when a block is appended out of order
+
+// Progress of the sweep through the block index. Entries below sweep_pos
+// have been swept and the survivors among them moved down below sweep_kept.
+// Blocks appended after the collection, at sweep_end and up, are left alone.
+static int sweeping = 0;
+static int lazy_sweep = 0;  // leave the sweep to gc_malloc()
+static size_t sweep_pos, sweep_kept, sweep_end;
+static header_t *sweep_hint = NULL;  // free block the sweep freed into last
+static size_t sweep_step;  // entries swept when nothing on the free list fits
+
+/*
+ * Make sure the block index has room for one more entry.
+ */
+static int reserve_block_index(void)
+{
+    header_t **new;
+    size_t new_max;
+
+    if (num_blocks < max_blocks)
+        return 0;
+
+    new_max = max_blocks ? max_blocks * 2 : 512;
+    if ((new = meta_realloc(blocks, max_blocks * sizeof(header_t *),
+                            new_max * sizeof(header_t *))) == NULL)
+        return -1;
+
+    blocks = new;
+    max_blocks = new_max;
+    return 0;
+}
+
+/*
+ * Append a newly used block to the index.
+ */
+static void add_to_block_index(header_t *bp)
+{
+    if (num_blocks > 0 && blocks[num_blocks - 1] > bp)
+        blocks_sorted = 0;
+    blocks[num_blocks++] = bp;
+    set_start(bp, 1);
+}
+
+static int compare_blocks(const void *a, const void *b)
+{
+    header_t *x = *(header_t * const *) a, *y = *(header_t * const *) b;
+    return (x > y) - (x < y);
+}
+
+static void sort_block_index(void)
+{
+    if (!blocks_sorted)
+        qsort(blocks, num_blocks, sizeof(header_t *), compare_blocks);
+    blocks_sorted = 1;
+}
+
+/*
+ * Find the allocated slot of a page that contains the address ptr, or NULL
+ * if ptr points at a free slot or at the page's own header.
+ */
+static header_t *find_slot(page_t *pg, long ptr)
+{
+    header_t *first = (header_t *) pg + PAGE_HEADER_UNITS, *sp;
+    unsigned int units = class_units[pg->cls];
+    long idx;
+
+    if (ptr < (long) first)
+        return NULL;
+    idx = (ptr - (long) first) / (long) (units * sizeof(header_t));
+    if (first + (idx + 1) * units > pg->bump)
+        return NULL;  // points past the slots handed out so far
+
+    sp = first + idx * units;
+    if (!(sp->flags & BLOCK_USED))
+        return NULL;
+    return sp;
+}
+
+/*
+ * Find the used block that contains the address ptr, or NULL if there is
+ * none. Pointers into a page resolve to the slot they point into. A pointer
+ * to a block's header counts too, since a thread stopped inside gc_malloc()
+ * may hold nothing else for the block it's about to return.
+ */
+static header_t *find_block(long ptr)
+{
+    chunk_t *cp = find_chunk((void *) ptr);
+    unsigned long bits;
+    size_t unit, w;
+    header_t *bp;
+
+    // Most words that aren't pointers don't even point into a chunk
+    if (cp == NULL || ptr < (long) cp->start || ptr >= (long) cp->end)
+        return NULL;
+
+    // Find the last page or large block that starts at or below ptr
+    unit = (ptr - (long) cp->start) / sizeof(header_t);
+    w = unit / BITS_PER_WORD;
+    bits = cp->starts[w] & (~0UL >> (BITS_PER_WORD - 1 - unit % BITS_PER_WORD));
+    while (bits == 0) {
+        if (w == 0)
+            return NULL;
+        bits = cp->starts[--w];
+    }
+    bp = cp->start + w * BITS_PER_WORD +
+         (BITS_PER_WORD - 1 - __builtin_clzl(bits));
+
+    if ((long) (bp + bp->size) <= ptr)
+        return NULL;
+    if (bp->flags & BLOCK_PAGE)
+        return find_slot((page_t *) bp, ptr);
+    return bp;
+}
+
+/*
+ * Scans the free list and look for a place to put the block.
+ */
+static void add_to_free_list(header_t *bp)
+{
+    header_t *p;
+
+    // Set p to the free block right before the new block
+    for (p = freep; !(bp > p && bp < p->next); p = p->next)
+        if (p >= p->next && (bp > p || bp < p->next))
+            break;
+
+    // Forward coalescence
+    if (bp + bp->size == p->next) {
+        bp->size += p->next->size;
+        bp->next = p->next->next;
+    } else
+        bp->next = p->next;
+
+    // Backward coalescence
+    if (p + p->size == bp) {
+        p->size += bp->size;
+        p->next = bp->next;
+    } else
+        p->next = bp;
+
+    // By setting freep to the free block right before the new block, we avoid
+    // having to traverse the entire free list again.
+    freep = p;
+}
+
+/*
+ * Map size bytes aligned to CHUNK_SIZE. size must be a multiple of CHUNK_SIZE.
+ */
+static void *map_aligned(size_t size)
+{
+    char *p, *aligned;
+
+    p = mmap(NULL, size + CHUNK_SIZE, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+
+    // Trim the excess on either side
+    aligned = (char *) (((unsigned long) p + CHUNK_SIZE - 1) & ~(CHUNK_SIZE - 1));
+    if (aligned > p)
+        munmap(p, aligned - p);
+    munmap(aligned + size, p + CHUNK_SIZE - aligned);
+#if USE_HUGE_PAGES && defined(MADV_HUGEPAGE)
+    madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+    return aligned;
+}
+
+/*
+ * Map a new chunk with room for a block of at least num_bytes, and put its
+ * space on the free list.
+ */
+static int new_chunk(size_t num_bytes)
+{
+    size_t size, total_units, num_words, num_cards, meta_units;
+    chunk_t *cp;
+    header_t *up;
+
+    // A chunk is CHUNK_SIZE bytes, unless the block needs more. The bitmaps
+    // and the card table take a little over 1/64 of the chunk, so leave
+    // more than that on top.
+    size = (num_bytes + num_bytes / 32 + MIN_ALLOC_SIZE + CHUNK_SIZE - 1) &
+           ~(CHUNK_SIZE - 1);
+
+    // Room for the chunk descriptor, its bitmaps and cards goes in front
+    total_units = size / sizeof(header_t);
+    num_words = (total_units + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    num_cards = (size + CARD_SIZE - 1) / CARD_SIZE;
+    meta_units = (sizeof(chunk_t) + 2 * num_words * sizeof(unsigned long) +
+                  num_cards + sizeof(header_t) - 1) / sizeof(header_t);
+
+    // Create space. Fresh mappings are zeroed, so the bitmaps start out clear.
+    if ((cp = map_aligned(size)) == NULL)
+        return -1;
+    cp->map_size = size;
+    cp->start = (header_t *) cp + meta_units;
+    cp->end = (header_t *) cp + total_units;
+    cp->marks = (unsigned long *) (cp + 1);
+    cp->starts = cp->marks + num_words;
+    cp->num_words = num_words;
+    cp->cards = (unsigned char *) (cp->starts + num_words);
+    cp->num_cards = num_cards;
+    if (map_chunk(cp, cp) == -1) {
+        map_chunk(cp, NULL);
+        munmap(cp, size);
+        return -1;
+    }
+    cp->next = chunk_list;
+    chunk_list = cp;
+    stats.more_core_calls++;
+    stats.heap_bytes += size;
+
+    // Create the header, add the new block to the free list
+    up = cp->start;
+    up->size = cp->end - cp->start;
+    up->flags = 0;
+    add_to_free_list(up);
+    return 0;
+}
+
+/*
+ * Request more memory from the kernel, with room for a block of at least
+ * num_bytes. The heap grows by heap_growth percent at a time, in chunks that
+ * can each be given back on their own.
+ */
+static header_t *more_core(size_t num_bytes)
+{
+    size_t grow = stats.heap_bytes / 100 * heap_growth, n;
+
+    if (new_chunk(num_bytes) == -1)
+        return NULL;
+    for (n = 1; n < MAX_GROWTH_CHUNKS && n * CHUNK_SIZE < grow; n++)
+        if (new_chunk(0) == -1)
+            break;
+    return freep;
+}
+
+/*
+ * Give the chunks that are entirely free back to the kernel. As long as the
+ * heap is no bigger than the collections aim for, they're kept mapped, so
+ * that the heap doesn't shrink only to grow again right away, but their
+ * pages are released all the same.
+ */
+static void release_empty_chunks(void)
+{
+    header_t *prevp, *p;
+    chunk_t *cp, **cpp;
+    unsigned long addr;
+
+    for (prevp = &base, p = base.next; p != &base; prevp = p, p = p->next) {
+        cp = find_chunk(p);
+        if (p != cp->start || p + p->size != cp->end)
+            continue;
+
+        if (stats.heap_bytes <= heap_goal && cp->map_size == CHUNK_SIZE) {
+            // Release every page after the free block's header
+            addr = ((unsigned long) (p + 1) + MIN_ALLOC_SIZE - 1) &
+                   ~(MIN_ALLOC_SIZE - 1);
+            madvise((void *) addr, (char *) cp->end - (char *) addr,
+                    MADV_DONTNEED);
+            continue;
+        }
+
+        prevp->next = p->next;
+        if (freep == p)
+            freep = prevp;
+        if (sweep_hint == p)
+            sweep_hint = prevp;
+        p = prevp;
+
+        for (cpp = &chunk_list; *cpp != cp; cpp = &(*cpp)->next)
+            ;
+        *cpp = cp->next;
+        stats.heap_bytes -= cp->map_size;
+        map_chunk(cp, NULL);
+        munmap(cp, cp->map_size);
+    }
+}
+
+/*** markers ***/
+
+// markers[0] is the thread running gc_collect(), the others are helper
+// threads, started when the collection first needs them
+static marker_t markers[MAX_MARK_THREADS];
+static int mark_threads = 1;  // markers asked for by gc_set_mark_threads()
+static int num_markers = 1;  // markers taking part in the mark phase
+static int num_helpers = 0;  // helper threads started so far
+static atomic_int idle_markers;  // markers that have run out of work
+static atomic_int mark_overflow;  // set when a block couldn't be pushed
+static sem_t mark_done;  // posted by a helper at the end of a mark phase
+
+// Root ranges of the collection, shared out to the markers in pieces of
+// ROOT_PIECE_WORDS words
+static range_t *roots = NULL;
+static size_t num_roots = 0;
+static size_t max_roots = 0;
+static size_t num_root_pieces = 0;
+static atomic_size_t next_root_piece;
+
+// A concurrent collection marks in the background while the program runs.
+// Meanwhile new blocks are allocated marked, and gc_write_barrier() shades
+// whatever a store overwrites, so that everything reachable when the mark
+// started ends up marked.
+static int concurrent = 0;  // see gc_set_concurrent()
+static int concurrent_started = 0;  // the background marker is running
+static sem_t concurrent_go;  // posted to start it on a mark
+static unsigned long cycles_done = 0;  // concurrent collections finished
+static pthread_cond_t cycle_cond = PTHREAD_COND_INITIALIZER;
+
+// Blocks shaded by the threads and handed over to the background marker
+static header_t **grey = NULL;
+static size_t num_grey = 0;
+static size_t max_grey = 0;
+static pthread_mutex_t grey_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Push a block on the bottom of a marker's deque. Only the owner pushes.
+ * Returns -1 if the deque is full.
+ */
+static int deque_push(marker_t *m, header_t *bp)
+{
+    long b = atomic_load_explicit(&m->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&m->top, memory_order_acquire);
+
+    if (m->buf == NULL || b - t >= DEQUE_SIZE)
+        return -1;
+    atomic_store_explicit(&m->buf[b & (DEQUE_SIZE - 1)], bp,
+                          memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&m->bottom, b + 1, memory_order_relaxed);
+    return 0;
+}
+
+/*
+ * Take a block off the bottom of the caller's own deque, or return NULL if
+ * it's empty.
+ */
+static header_t *deque_take(marker_t *m)
+{
+    long b = atomic_load_explicit(&m->bottom, memory_order_relaxed) - 1;
+    long t;
+    header_t *bp = NULL;
+
+    atomic_store_explicit(&m->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    t = atomic_load_explicit(&m->top, memory_order_relaxed);
+    if (t <= b) {
+        bp = atomic_load_explicit(&m->buf[b & (DEQUE_SIZE - 1)],
+                                  memory_order_relaxed);
+        if (t < b)
+            return bp;
+
+        // The last block left, which a thief may be taking at the same time
+        if (!atomic_compare_exchange_strong_explicit(&m->top, &t, t + 1,
+                                                     memory_order_seq_cst,
+                                                     memory_order_relaxed))
+            bp = NULL;
+    }
+    atomic_store_explicit(&m->bottom, b + 1, memory_order_relaxed);
+    return bp;
+}
+
+/*
+ * Steal a block off the top of another marker's deque. Returns NULL if it's
+ * empty, or if another marker took the block first, in which case *lost is
+ * set since there may be more.
+ */
+static header_t *deque_steal(marker_t *m, int *lost)
+{
+    long t = atomic_load_explicit(&m->top, memory_order_acquire);
+    long b;
+    header_t *bp;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    b = atomic_load_explicit(&m->bottom, memory_order_acquire);
+    if (t >= b)
+        return NULL;
+
+    bp = atomic_load_explicit(&m->buf[t & (DEQUE_SIZE - 1)],
+                              memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&m->top, &t, t + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed)) {
+        *lost = 1;
+        return NULL;
+    }
+    return bp;
+}
+
+/*
+ * Hand the blocks a thread has shaded over to the background marker.
+ */
+static void flush_satb(gc_thread_t *t)
+{
+    header_t **new;
+    size_t new_max;
+
+    pthread_mutex_lock(&grey_lock);
+    if (num_grey + t->satb_len > max_grey) {
+        new_max = max_grey ? max_grey * 2 : 4096;
+        if ((new = meta_realloc(grey, max_grey * sizeof(header_t *),
+                                new_max * sizeof(header_t *))) == NULL) {
+            // They stay marked, and the remark finds them with a rescan
+            atomic_store(&mark_overflow, 1);
+            t->satb_len = 0;
+            pthread_mutex_unlock(&grey_lock);
+            return;
+        }
+        grey = new;
+        max_grey = new_max;
+    }
+    memcpy(&grey[num_grey], t->satb, t->satb_len * sizeof(header_t *));
+    num_grey += t->satb_len;
+    t->satb_len = 0;
+    pthread_mutex_unlock(&grey_lock);
+}
+
+/*
+ * Move the blocks handed over by the threads to a marker's deque. Returns
+ * whether there were any.
+ */
+static int drain_grey(marker_t *m)
+{
+    size_t i, n;
+
+    pthread_mutex_lock(&grey_lock);
+    n = num_grey;
+    for (i = 0; i < n; i++)
+        if (deque_push(m, grey[i]) == -1)
+            atomic_store(&mark_overflow, 1);
+    num_grey = 0;
+    pthread_mutex_unlock(&grey_lock);
+    return n > 0;
+}
+
+/*** nursery ***/
+
+static int generational = 0;  // see gc_set_generational()
+static int young_only = 0;  // the mark phase only follows young blocks
+
+// The nursery space handed out since the last collection
+static tlab_t *tlabs = NULL;
+static size_t num_tlabs = 0;
+static size_t max_tlabs = 0;
+static size_t nursery_units = 0;  // in all of them
+
+/*
+ * Make sure the nursery has room for one more entry.
+ */
+static int reserve_tlabs(void)
+{
+    tlab_t *new;
+    size_t new_max;
+
+    if (num_tlabs < max_tlabs)
+        return 0;
+
+    new_max = max_tlabs ? max_tlabs * 2 : 64;
+    if ((new = meta_realloc(tlabs, max_tlabs * sizeof(tlab_t),
+                            new_max * sizeof(tlab_t))) == NULL)
+        return -1;
+
+    tlabs = new;
+    max_tlabs = new_max;
+    return 0;
+}
+
+/*
+ * Take a thread's nursery space away, covering what it didn't use with a
+ * filler block. Called with heap_lock held, or with the thread stopped.
+ */
+static void retire_tlab(gc_thread_t *t)
+{
+    if (t->tlab != NULL && t->tlab < t->tlab_end) {
+        t->tlab->size = t->tlab_end - t->tlab;
+        t->tlab->flags = 0;
+    }
+    t->tlab = t->tlab_end = NULL;
+}
+
+static int compare_tlabs(const void *a, const void *b)
+{
+    const tlab_t *x = a, *y = b;
+    return (x->start > y->start) - (x->start < y->start);
+}
+
+/*** threads ***/
+
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_key;  // unregisters a thread when it exits
+static __thread gc_thread_t *self;  // the calling thread's record
+static gc_thread_t *threads = NULL;  // every registered thread
+static sem_t stop_ack;  // posted by a thread once it has stopped or resumed
+static volatile sig_atomic_t world_stopped = 0;
+
+static void initialize();
+
+/*
+ * Find the bottom (highest address) of the calling thread's stack.
+ */
+static long *find_stack_bottom(void)
+{
+    pthread_attr_t attr;
+    unsigned long start;
+    size_t size;
+    void *addr;
+    char buf[1024], *p;
+    FILE *fp;
+    int i, ok;
+
+    if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+        ok = pthread_attr_getstack(&attr, &addr, &size) == 0;
+        pthread_attr_destroy(&attr);
+        if (ok)
+            return (long *) ((char *) addr + size);
+    }
+
+    // Fall back to startstack, the 28th field of /proc/self/stat. The second
+    // field is the command name in parentheses, which may contain spaces, so
+    // count the fields from the last ')'.
+    if ((fp = fopen("/proc/self/stat", "r")) == NULL)
+        return NULL;
+    p = fgets(buf, sizeof(buf), fp);
+    fclose(fp);
+    if (p == NULL || (p = strrchr(buf, ')')) == NULL)
+        return NULL;
+    for (i = 2; i < 28 && p != NULL; i++)
+        p = strchr(p + 1, ' ');
+    if (p == NULL || sscanf(p, "%lu", &start) != 1)
+        return NULL;
+    return (long *) start;
+}
+
+/*
+ * Park the calling thread until the collector resumes the world. Registers
+ * are spilled into this frame first, and the collector scans the stack from
+ * here up.
+ */
+static void suspend_self(gc_thread_t *t)
+{
+    sigset_t mask, old;
+    jmp_buf regs;
+
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, &old);
+
+#ifdef __GNUC__
+    __builtin_unwind_init();
+#endif
+    setjmp(regs);
+    t->stop_pending = 0;
+    t->stack_top = (long *) regs;
+    sem_post(&stop_ack);
+
+    sigdelset(&mask, GC_SIG_RESUME);
+    while (world_stopped)
+        sigsuspend(&mask);
+    t->stack_top = NULL;
+    sem_post(&stop_ack);
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void suspend_handler(int sig)
+{
+    gc_thread_t *t = self;
+    int saved_errno = errno;
+
+    (void) sig;
+    if (t == NULL || !world_stopped)
+        return;
+
+    // A thread in the middle of taking a slot from its page stops once it's
+    // done, so the collector never sees a half-updated page
+    if (t->in_alloc)
+        t->stop_pending = 1;
+    else
+        suspend_self(t);
+    errno = saved_errno;
+}
+
+static void resume_handler(int sig)
+{
+    (void) sig;
+}
+
+/*
+ * Shade the block that the pointer old, about to be overwritten, points to.
+ * Its contents get scanned by the background marker, as part of the
+ * snapshot of the heap taken when the mark started. The thread isn't
+ * stopped in the middle of recording it, like in thread_alloc().
+ */
+static void satb_log(gc_thread_t *t, void *old)
+{
+    header_t *bp;
+
+    t->in_alloc = 1;
+    atomic_signal_fence(memory_order_seq_cst);
+    if (marking && (bp = find_block((long) old)) != NULL &&
+        !test_and_set_mark(bp) && !(bp->flags & BLOCK_ATOMIC)) {
+        if (t->satb_len == SATB_SIZE)
+            flush_satb(t);
+        t->satb[t->satb_len++] = bp;
+    }
+    atomic_signal_fence(memory_order_seq_cst);
+    t->in_alloc = 0;
+    atomic_signal_fence(memory_order_seq_cst);
+
+    if (t->stop_pending)  // a collection is waiting for this thread
+        suspend_self(t);
+}
+
+/*
+ * Stop every other registered thread. Called with heap_lock held, so no
+ * thread can be stopped while it's in the middle of changing the heap.
+ */
+static void stop_world(void)
+{
+    gc_thread_t *t;
+    int n = 0;
+
+    world_stopped = 1;
+    for (t = threads; t != NULL; t = t->next)
+        if (t != self && pthread_kill(t->id, GC_SIG_SUSPEND) == 0) {
+            t->stopped = 1;
+            n++;
+        }
+    while (n > 0)
+        if (sem_wait(&stop_ack) == 0)
+            n--;
+}
+
+static void resume_world(void)
+{
+    gc_thread_t *t;
+    int n = 0;
+
+    // A thread may notice world_stopped before the signal arrives, but it
+    // still gets one, and every stopped thread acknowledges once, so that no
+    // stray acknowledgement is left over for the next stop_world()
+    world_stopped = 0;
+    for (t = threads; t != NULL; t = t->next)
+        if (t->stopped) {
+            t->stopped = 0;
+            pthread_kill(t->id, GC_SIG_RESUME);
+            n++;
+        }
+    while (n > 0)
+        if (sem_wait(&stop_ack) == 0)
+            n--;
+}
+
+/*
+ * Register the calling thread with the collector, so that its stack is
+ * scanned for roots. gc_malloc() and gc_collect() do this on first use.
+ */
+void gc_register_thread(void)
+{
+    gc_thread_t *t;
+
+    pthread_once(&init_once, initialize);
+    if (self != NULL)
+        return;
+
+    if ((t = meta_realloc(NULL, 0, sizeof(gc_thread_t))) == NULL)
+        return;
+    t->id = pthread_self();
+    // Round down, scan_region() needs word-aligned bounds
+    t->stack_bottom = (long *) ((long) find_stack_bottom() &
+                                ~(sizeof(long) - 1));
+
+    pthread_mutex_lock(&heap_lock);
+    t->next = threads;
+    threads = t;
+    self = t;
+    pthread_mutex_unlock(&heap_lock);
+    pthread_setspecific(thread_key, t);
+}
+
+/*
+ * Unregister the calling thread. Its pages go back to the bins at the next
+ * sweep, and its young blocks stay in the nursery. Registered threads are
+ * unregistered automatically when they exit.
+ */
+void gc_unregister_thread(void)
+{
+    gc_thread_t *t = self, **tp;
+
+    if (t == NULL)
+        return;
+
+    pthread_mutex_lock(&heap_lock);
+    for (tp = &threads; *tp != t; tp = &(*tp)->next)
+        ;
+    *tp = t->next;
+    retire_tlab(t);
+    if (t->satb_len > 0)
+        flush_satb(t);
+    self = NULL;
+    pthread_mutex_unlock(&heap_lock);
+
+    pthread_setspecific(thread_key, NULL);
+    munmap(t, sizeof(gc_thread_t));
+}
+
+static void thread_exit(void *t)
+{
+    (void) t;
+    gc_unregister_thread();
+}
+
+/*** malloc ***/
+
+/*
+ * Take between min_units and max_units units off the free list, as many as
+ * the first big enough free block has, asking the kernel for more memory if
+ * nothing is big enough.
+ */
+static header_t *alloc_between(size_t min_units, size_t max_units)
+{
+    header_t *p, *prevp;
+    size_t num_units;
+
+    prevp = freep;
+
+    // Cycle through the list of free blocks, finding space to allocate
+    for (p = prevp->next;; prevp = p, p = p->next) {
+        if (p->size >= min_units) {  // big enough
+            num_units = p->size < max_units ? p->size : max_units;
+            if (p->size == num_units) {  // exact size
+                prevp->next = p->next;
+                if (p == sweep_hint)
+                    sweep_hint = prevp;
+            }
+            else {
+                p->size -= num_units;
+                p += p->size;
+                p->size = num_units;
+            }
+            p->flags = 0;
+
+            freep = prevp;  // next fit strategy
+            return p;
+        }
+
+        if (p == freep && sweeping) {
+            // Sweep some more before growing the heap, it may free a big
+            // enough block. Every pass that fails sweeps twice as much as the
+            // last, so a free list of small holes is only walked a few times
+            // per sweep and not once every few blocks
+            sweep_blocks(sweep_step);
+            sweep_step *= 2;
+            p = freep;
+        } else if (p == freep) {  // not enough memory
+            p = more_core(min_units * sizeof(header_t));
+            if (p == NULL)  // request for more memory failed
+                return NULL;
+        }
+    }
+}
+
+/*
+ * Take num_units units off the free list.
+ */
+static header_t *alloc_units(size_t num_units)
+{
+    return alloc_between(num_units, num_units);
+}
+
+/*
+ * Take a fresh page for slots of size class cls off the free list. Its slots
+ * are handed out by bumping pg->bump, so nothing is carved up front.
+ */
+static page_t *new_page(unsigned int cls)
+{
+    page_t *pg;
+
+    if ((pg = (page_t *) alloc_units(PAGE_UNITS)) == NULL)
+        return NULL;
+    pg->hdr.flags = BLOCK_PAGE;
+    pg->cls = cls;
+    pg->free = NULL;
+    pg->bump = (header_t *) pg + PAGE_HEADER_UNITS;
+    pg->live = 0;
+
+    add_to_block_index(&pg->hdr);
+    return pg;
+}
+
+/*
+ * Take a slot from a page, preferring slots freed by the sweep over fresh
+ * ones, and give it the flags and layout of the block asked for. Returns
+ * NULL if the page is full.
+ */
+static header_t *take_slot(page_t *pg, unsigned int flags,
+                           const gc_layout_t *layout)
+{
+    unsigned int units = class_units[pg->cls];
+    header_t *sp;
+
+    if ((sp = pg->free) != NULL)
+        pg->free = sp->next;
+    else if (pg->bump + units <= (header_t *) pg + pg->hdr.size) {
+        sp = pg->bump;
+        pg->bump += units;
+        sp->size = units;
+    } else
+        return NULL;
+
+    sp->flags = BLOCK_USED | flags;
+    sp->next = (header_t *) layout;
+    return sp;
+}
+
+/*
+ * Allocate a slot of size class cls from the calling thread's own page,
+ * without taking any lock. Returns NULL if the thread needs a new page.
+ */
+static header_t *thread_alloc(gc_thread_t *t, unsigned int cls,
+                              unsigned int flags, const gc_layout_t *layout)
+{
+    header_t *sp = NULL;
+    page_t *pg;
+
+    t->in_alloc = 1;
+    atomic_signal_fence(memory_order_seq_cst);
+    if ((pg = t->pages[cls]) != NULL &&
+        (sp = take_slot(pg, flags, layout)) != NULL && marking)
+        test_and_set_mark(sp);  // allocated black during a concurrent mark
+    atomic_signal_fence(memory_order_seq_cst);
+    t->in_alloc = 0;
+    atomic_signal_fence(memory_order_seq_cst);
+
+    if (t->stop_pending)  // a collection is waiting for this thread
+        suspend_self(t);
+    return sp;
+}
+
+/*
+ * Give the thread a page of size class cls with room in it, in place of its
+ * full one. Called with heap_lock held.
+ */
+static int refill(gc_thread_t *t, unsigned int cls)
+{
+    page_t *pg;
+
+    // Only the block index refers to the full page now. The sweep puts it
+    // back in the bin once some of its slots are freed.
+    t->pages[cls] = NULL;
+
+    // Spread a pending lazy sweep over the refills. Pages that haven't been
+    // swept since the last collection aren't in the bins yet.
+    if (sweeping)
+        sweep_blocks(LAZY_SWEEP_STEP);
+    while ((pg = bins[cls]) == NULL && sweeping)
+        sweep_blocks(LAZY_SWEEP_STEP);
+
+    if (pg != NULL)
+        bins[cls] = pg->next_page;
+    else if (reserve_block_index() == -1 || (pg = new_page(cls)) == NULL)
+        return -1;
+
+    // Count the slots the thread can take from the page as allocated
+    allocated += ((PAGE_UNITS - PAGE_HEADER_UNITS) / class_units[cls] -
+                  pg->live) * class_units[cls] * sizeof(header_t);
+    t->pages[cls] = pg;
+    return 0;
+}
+
+/*
+ * Allocate a young block of num_units units by bumping the calling thread's
+ * nursery pointer, without taking any lock. Returns NULL if the thread needs
+ * more nursery space.
+ */
+static header_t *nursery_alloc(gc_thread_t *t, size_t num_units,
+                               unsigned int flags, const gc_layout_t *layout)
+{
+    header_t *p = NULL;
+
+    t->in_alloc = 1;
+    atomic_signal_fence(memory_order_seq_cst);
+    if (t->tlab != NULL && t->tlab + num_units <= t->tlab_end) {
+        p = t->tlab;
+        t->tlab += num_units;
+        p->size = num_units;
+        p->flags = BLOCK_YOUNG | flags;
+        p->next = (header_t *) layout;
+        set_start(p, 1);
+        if (marking)
+            test_and_set_mark(p);
+    }
+    atomic_signal_fence(memory_order_seq_cst);
+    t->in_alloc = 0;
+    atomic_signal_fence(memory_order_seq_cst);
+
+    if (t->stop_pending)  // a collection is waiting for this thread
+        suspend_self(t);
+    return p;
+}
+
+/*
+ * Give the thread new nursery space for a block of num_units units, in place
+ * of what it has used up. Any free block that is big enough will do, so that
+ * the gaps left between the survivors of the last collection are filled
+ * again. Returns 1 if the nursery is full and needs a minor collection
+ * first, -1 if there is no memory. Called with heap_lock held.
+ */
+static int refill_tlab(gc_thread_t *t, size_t num_units)
+{
+    header_t *p;
+
+    retire_tlab(t);
+    // No minor collection during a concurrent mark, which promotes the
+    // nursery at its end anyway
+    if (nursery_units >= NURSERY_SIZE / sizeof(header_t) && !marking)
+        return 1;
+
+    // Spread a pending lazy sweep over the refills, like refill() does
+    if (sweeping)
+        sweep_blocks(LAZY_SWEEP_STEP);
+    if (reserve_tlabs() == -1 ||
+        (p = alloc_between(num_units, TLAB_UNITS)) == NULL)
+        return -1;
+
+    tlabs[num_tlabs].start = p;
+    tlabs[num_tlabs].end = p + p->size;
+    num_tlabs++;
+    nursery_units += p->size;
+    t->tlab = p;
+    t->tlab_end = p + p->size;
+    return 0;
+}
+
+/*
+ * Allocate a block with the given flags and layout. Small requests come from
+ * a page owned by the calling thread, or in generational mode from its
+ * nursery space, larger ones from the free list.
+ */
+static void *allocate(size_t alloc_size, unsigned int flags,
+                      const gc_layout_t *layout)
+{
+    gc_thread_t *t;
+    size_t num_units;
+    unsigned int cls;
+    header_t *p;
+    int ok, due, r;
+
+    if ((t = self) == NULL) {
+        gc_register_thread();
+        if ((t = self) == NULL)
+            return NULL;
+    }
+
+    // Get malloc size in terms of 16 byte-chunks
+    // Note: (alloc_size + sizeof(header_t) - 1) ensures we obtain the right
+    //       unit size
+    num_units = (alloc_size + sizeof(header_t) - 1) / sizeof(header_t) + 1;
+
+    // Everything allocated during a concurrent mark survives it, so the
+    // nursery would only fill up with blocks to promote
+    if (num_units <= SMALL_MAX_UNITS && generational && !marking) {
+        while ((p = nursery_alloc(t, num_units, flags, layout)) == NULL) {
+            pthread_mutex_lock(&heap_lock);
+            due = collection_due();
+            r = due ? 0 : refill_tlab(t, num_units);
+            pthread_mutex_unlock(&heap_lock);
+            if (due)
+                collect(1);
+            else if (r == 1)
+                minor_collect();
+            else if (r == -1)
+                return NULL;
+        }
+        return (void *) (p + 1);
+    }
+
+    if (num_units <= SMALL_MAX_UNITS) {
+        for (cls = 0; class_units[cls] < num_units; cls++)
+            ;
+        while ((p = thread_alloc(t, cls, flags, layout)) == NULL) {
+            pthread_mutex_lock(&heap_lock);
+            due = collection_due();
+            ok = due || refill(t, cls) == 0;
+            pthread_mutex_unlock(&heap_lock);
+            if (due)
+                collect(1);
+            else if (!ok)
+                return NULL;
+        }
+        return (void *) (p + 1);
+    }
+
+    pthread_mutex_lock(&heap_lock);
+    p = NULL;
+    // A large block needs an entry in the block index
+    if (reserve_block_index() == 0) {
+        // Spread a pending lazy sweep over the allocations
+        if (sweeping)
+            sweep_blocks(LAZY_SWEEP_STEP);
+        if ((p = alloc_units(num_units)) != NULL) {
+            p->flags = flags;
+            p->next = (header_t *) layout;
+            add_to_block_index(p);
+            if (marking)
+                test_and_set_mark(p);
+            allocated += num_units * sizeof(header_t);
+        }
+    }
+    due = collection_due();
+    pthread_mutex_unlock(&heap_lock);
+
+    // p is on this thread's stack, so the collection keeps it
+    if (due)
+        collect(1);
+    return p == NULL ? NULL : (void *) (p + 1);
+}
+
+/*
+ * Allocate memory.
+ */
+void *gc_malloc(size_t alloc_size)
+{
+    return allocate(alloc_size, 0, NULL);
+}
+
+/*
+ * Allocate memory that never holds pointers to the heap, such as strings and
+ * numeric buffers. The collector doesn't scan it, so nothing it holds that
+ * looks like a pointer keeps other blocks alive.
+ */
+void *gc_malloc_atomic(size_t alloc_size)
+{
+    return allocate(alloc_size, BLOCK_ATOMIC, NULL);
+}
+
+/*
+ * Allocate memory whose pointers are only where layout says, so that the
+ * collector only looks at those words. See gc_make_layout().
+ */
+void *gc_malloc_typed(size_t alloc_size, const gc_layout_t *layout)
+{
+    return allocate(alloc_size, BLOCK_TYPED, layout);
+}
+
+/*
+ * Resize a block from gc_malloc() or its kin to alloc_size bytes, keeping its
+ * kind. A block that is big enough already is returned as it is, others are
+ * copied to a new block and the old one is left to the collector. A NULL p
+ * allocates, like realloc().
+ */
+void *gc_realloc(void *p, size_t alloc_size)
+{
+    header_t *bp, *np;
+    size_t old_size, card, last;
+    chunk_t *cp;
+    void *new;
+
+    if (p == NULL)
+        return gc_malloc(alloc_size);
+    bp = (header_t *) p - 1;
+    old_size = (bp->size - 1) * sizeof(header_t);
+    if (alloc_size <= old_size)
+        return p;
+
+    // p is on this thread's stack, so a collection on the way keeps it
+    new = allocate(alloc_size, bp->flags & (BLOCK_ATOMIC | BLOCK_TYPED),
+                   bp->flags & BLOCK_TYPED ? (gc_layout_t *) bp->next : NULL);
+    if (new == NULL)
+        return NULL;
+    memcpy(new, p, old_size);
+
+    // The pointers copied into an old block are stores that the write
+    // barrier didn't see, so their cards are marked here
+    np = (header_t *) new - 1;
+    if (generational && !(np->flags & (BLOCK_YOUNG | BLOCK_ATOMIC)) &&
+        (cp = find_chunk(new)) != NULL) {
+        card = ((char *) new - (char *) cp->start) / CARD_SIZE;
+        last = ((char *) new + old_size - 1 - (char *) cp->start) / CARD_SIZE;
+        for (; card <= last; card++)
+            cp->cards[card] = 1;
+    }
+    return new;
+}
+
+/*
+ * Make a layout for gc_malloc_typed() out of num_words bits of bitmap, bit i
+ * being set if word i may hold a pointer. Layouts are never freed, they're
+ * meant to be made once per type. Returns NULL if there is no memory.
+ */
+gc_layout_t *gc_make_layout(const unsigned long *bitmap, size_t num_words)
+{
+    size_t n = (num_words + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    gc_layout_t *lp;
+
+    if (num_words == 0 ||
+        (lp = malloc(sizeof(gc_layout_t) + n * sizeof(unsigned long))) == NULL)
+        return NULL;
+    lp->num_words = num_words;
+    memcpy(lp->bitmap, bitmap, n * sizeof(unsigned long));
+    return lp;
+}
+
+/*** mark and sweep ***/
+
+/*
+ * Mark a block and push it on the marker's deque so its contents get scanned
+ * later. A block that is already marked has already been pushed, so every
+ * block is pushed at most once per collection.
+ */
+static void mark_block(marker_t *m, header_t *bp)
+{
+    // A block without pointers has nothing to scan, marking it is enough
+    if (test_and_set_mark(bp) || (bp->flags & BLOCK_ATOMIC))
+        return;
+
+    // If the deque is full, the block stays marked but unscanned. scan_heap()
+    // picks it up again with a rescan.
+    if (deque_push(m, bp) == -1)
+        atomic_store(&mark_overflow, 1);
+}
+
+/*
+ * Scan a region of memory and mark any items in the used list if there exists
+ * a pointer in the region that points to the item.
+ *
+ * Note: Both arguments must be word-aligned.
+ */
+static void scan_region(marker_t *m, long *sp, long *end)
+{
+    header_t *bp;
+
+    // Scan through the region 8 bytes (size of a pointer) at a time. If the
+    // value (note: it may not be a pointer, but we check anyway) points to an
+    // address within a used block, then the allocated space is still being
+    // used. So we mark the header. A minor collection leaves old blocks be.
+    for (; sp < end; sp++)
+        if ((bp = find_block(*sp)) != NULL &&
+            (!young_only || (bp->flags & BLOCK_YOUNG)))
+            mark_block(m, bp);
+}
+
+/*
+ * Scan the contents of a marked block, a slot or a large block, for
+ * pointers. Blocks from gc_malloc_atomic() have none, and only the words
+ * that the layout of a block from gc_malloc_typed() points out are looked
+ * at.
+ */
+static void scan_block(marker_t *m, header_t *bp)
+{
+    long *sp = (long *) (bp + 1), *end = (long *) (bp + bp->size);
+    const gc_layout_t *lp;
+    size_t w;
+
+    if (bp->flags & BLOCK_ATOMIC)
+        return;
+    if (!(bp->flags & BLOCK_TYPED)) {
+        scan_region(m, sp, end);
+        m->heap_bytes += (char *) end - (char *) sp;
+        return;
+    }
+
+    lp = (const gc_layout_t *) bp->next;
+    for (w = 0; sp < end; sp++) {
+        if ((lp->bitmap[w / BITS_PER_WORD] >> (w % BITS_PER_WORD)) & 1) {
+            scan_region(m, sp, sp + 1);
+            m->heap_bytes += sizeof(long);
+        }
+        if (++w == lp->num_words)
+            w = 0;
+    }
+}
+
+/*
+ * Scan every marked slot of a page.
+ */
+static void rescan_page(marker_t *m, page_t *pg)
+{
+    unsigned int units = class_units[pg->cls];
+    header_t *sp;
+
+    for (sp = (header_t *) pg + PAGE_HEADER_UNITS; sp < pg->bump; sp += units)
+        if ((sp->flags & BLOCK_USED) && is_marked(sp))
+            scan_block(m, sp);
+}
+
+/*
+ * Scan every marked young block.
+ */
+static void rescan_nursery(marker_t *m)
+{
+    header_t *p;
+    size_t i;
+
+    for (i = 0; i < num_tlabs; i++)
+        for (p = tlabs[i].start; p < tlabs[i].end; p += p->size)
+            if ((p->flags & BLOCK_YOUNG) && is_marked(p))
+                scan_block(m, p);
+}
+
+/*
+ * Add a range of memory to scan for roots. Both bounds must be word-aligned.
+ */
+static void add_root(long *start, long *end)
+{
+    range_t *new;
+    size_t new_max;
+
+    if (num_roots == max_roots) {
+        new_max = max_roots ? max_roots * 2 : 64;
+        if ((new = meta_realloc(roots, max_roots * sizeof(range_t),
+                                new_max * sizeof(range_t))) == NULL) {
+            // Scan it now, the markers pick up what it reaches
+            scan_region(&markers[0], start, end);
+            markers[0].root_bytes += (char *) end - (char *) start;
+            return;
+        }
+        roots = new;
+        max_roots = new_max;
+    }
+    roots[num_roots].start = start;
+    roots[num_roots].end = end;
+    num_roots++;
+    num_root_pieces += (end - start + ROOT_PIECE_WORDS - 1) / ROOT_PIECE_WORDS;
+}
+
+/*
+ * Add the dirty cards as roots, for the pointers to young blocks that were
+ * stored in old ones, and clean them. Runs of dirty cards make one range.
+ */
+static void add_dirty_cards(void)
+{
+    chunk_t *cp;
+    size_t i, j;
+    long *start, *end;
+
+    for (cp = chunk_list; cp != NULL; cp = cp->next)
+        for (i = 0; i < cp->num_cards; i = j) {
+            if (!cp->cards[i]) {
+                j = i + 1;
+                continue;
+            }
+            for (j = i; j < cp->num_cards && cp->cards[j]; j++)
+                cp->cards[j] = 0;
+
+            start = (long *) ((char *) cp->start + i * CARD_SIZE);
+            end = (long *) ((char *) cp->start + j * CARD_SIZE);
+            if (end > (long *) cp->end)
+                end = (long *) cp->end;
+            if (start < end)
+                add_root(start, end);
+        }
+}
+
+/*
+ * Claim the next piece of the root ranges. Returns 0 once they're all gone.
+ */
+static int claim_root_piece(long **sp, long **end)
+{
+    size_t piece = atomic_fetch_add(&next_root_piece, 1), i, n;
+
+    if (piece >= num_root_pieces)
+        return 0;
+    for (i = 0;; i++) {
+        n = (roots[i].end - roots[i].start + ROOT_PIECE_WORDS - 1) /
+            ROOT_PIECE_WORDS;
+        if (piece < n)
+            break;
+        piece -= n;
+    }
+    *sp = roots[i].start + piece * ROOT_PIECE_WORDS;
+    *end = roots[i].end - *sp > ROOT_PIECE_WORDS ? *sp + ROOT_PIECE_WORDS
+                                                 : roots[i].end;
+    return 1;
+}
+
+/*
+ * Steal a block from any other marker. Sets *lost if a steal failed only
+ * because of another thief.
+ */
+static header_t *steal_block(marker_t *m, int *lost)
+{
+    int me = m - markers, i;
+    header_t *bp;
+
+    *lost = 0;
+    for (i = 1; i < num_markers; i++)
+        if ((bp = deque_steal(&markers[(me + i) % num_markers], lost)) != NULL)
+            return bp;
+    return NULL;
+}
 
-#define MIN_ALLOC_SIZE 4096  // page-sized chunk
+static int deques_empty(void)
+{
+    int i;
 
-typedef struct header {
-    unsigned int size;
-    struct header *next;
-} header_t;
+    for (i = 0; i < num_markers; i++)
+        if (atomic_load(&markers[i].top) < atomic_load(&markers[i].bottom))
+            return 0;
+    return 1;
+}
+
+/*
+ * Mark as one of the markers until all of them are out of work. A marker
+ * scans its own grey blocks first, then the roots, then steals.
+ */
+static void mark_loop(marker_t *m)
+{
+    header_t *bp;
+    long *sp, *end;
+    int lost;
 
-#define UNTAG(p) ((header_t *) ((long) p & 0xfffffffffffffffc))
+    for (;;) {
+        if ((bp = deque_take(m)) != NULL ||
+            (bp = steal_block(m, &lost)) != NULL) {
+            scan_block(m, bp);
+            continue;
+        }
+        if (claim_root_piece(&sp, &end)) {
+            scan_region(m, sp, end);
+            m->root_bytes += (char *) end - (char *) sp;
+            continue;
+        }
+        if (lost)
+            continue;
 
-// unsigned long stack_bottom;
+        // Only a marker that isn't idle can push, so once every marker is
+        // idle, every deque is empty and stays that way
+        atomic_fetch_add(&idle_markers, 1);
+        while (deques_empty())
+            if (atomic_load(&idle_markers) == num_markers)
+                return;
+            else
+                sched_yield();
+        atomic_fetch_sub(&idle_markers, 1);
+    }
+}
 
-/*** header operations ***/
+static void *helper_main(void *arg)
+{
+    marker_t *m = arg;
 
-static header_t base = {0, &base};  // zero sized block to start with
-static header_t *freep = &base;  // pointer to the first free block of memory
-static header_t *usedp = NULL;  // pointer to the first used block of memory
+    for (;;) {
+        while (sem_wait(&m->go) != 0)
+            ;
+        mark_loop(m);
+        sem_post(&mark_done);
+    }
+    return NULL;
+}
 
 /*
- * Scans the free list and look for a place to put the block.
+ * Start helper threads until there are as many markers as asked for, or as
+ * many as could be started. Helpers block every signal, they're never
+ * stopped and don't take part in the program otherwise.
  */
-static void add_to_free_list(header_t *bp)
+static void start_helpers(void)
 {
-    header_t *p;
+    sigset_t mask, old;
+    marker_t *m;
+    int err;
 
-    // Set p to the free block right before the new block
-    for (p = freep; !(bp > p && bp < p->next); p = p->next)
-        if (p >= p->next && (bp > p || bp < p->next))
+    if (markers[0].buf == NULL)
+        markers[0].buf = meta_realloc(NULL, 0, DEQUE_SIZE *
+                                               sizeof(*markers[0].buf));
+
+    while (num_helpers + 1 < mark_threads) {
+        m = &markers[num_helpers + 1];
+        if ((m->buf = meta_realloc(NULL, 0, DEQUE_SIZE * sizeof(*m->buf))) ==
+            NULL)
             break;
+        sem_init(&m->go, 0, 0);
 
-    // Forward coalescence
-    if (bp + bp->size == p->next) {
-        bp->size += p->next->size;
-        bp->next = p->next->next;
-    } else
-        bp->next = p->next;
+        sigfillset(&mask);
+        pthread_sigmask(SIG_BLOCK, &mask, &old);
+        err = pthread_create(&m->id, NULL, helper_main, m);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        if (err != 0) {
+            munmap(m->buf, DEQUE_SIZE * sizeof(*m->buf));
+            m->buf = NULL;
+            break;
+        }
+        num_helpers++;
+    }
+    num_markers = mark_threads < num_helpers + 1 ? mark_threads
+                                                 : num_helpers + 1;
+}
 
-    // Backward coalescence
-    if (p + p->size == bp) {
-        p->size += bp->size;
-        p->next = bp->next;
-    } else
-        p->next = bp;
+/*
+ * Run a mark phase on every marker and wait for all of them to finish.
+ */
+static void mark_parallel(void)
+{
+    int i;
 
-    // By setting freep to the free block right before the new block, we avoid
-    // having to traverse the entire free list again.
-    freep = p;
+    atomic_store(&idle_markers, 0);
+    for (i = 1; i < num_markers; i++)
+        sem_post(&markers[i].go);
+    mark_loop(&markers[0]);
+    for (i = 1; i < num_markers; i++)
+        while (sem_wait(&mark_done) != 0)
+            ;
 }
 
 /*
- * Request more memory from the kernel.
+ * Trace everything reachable from the roots and the blocks marked so far.
  */
-static header_t *more_core(size_t num_bytes)
+static void scan_heap(void)
 {
-    void *vp;
-    header_t *up;
+    header_t *bp;
+    size_t i;
 
-    // Determine size to allocate
-    if (num_bytes < MIN_ALLOC_SIZE) num_bytes = MIN_ALLOC_SIZE;
+    for (;;) {
+        // Scan the grey blocks. Anything they point to that isn't marked yet
+        // is marked and pushed in turn.
+        mark_parallel();
 
-    // Create space
-    if ((vp = sbrk(num_bytes)) == (void *) -1)
-        return NULL;
+        if (!atomic_load(&mark_overflow))
+            break;
 
-    // Create the header, add the new block to the free list
-    up = (header_t *) vp;
-    up->size = num_bytes / sizeof(header_t);
-    add_to_free_list(up);
-    return freep;
+        // A deque filled up, so some blocks were marked without being
+        // pushed. Rescan every marked block to find them.
+        atomic_store(&mark_overflow, 0);
+        rescan_nursery(&markers[0]);
+        for (i = 0; !young_only && i < num_blocks; i++) {
+            bp = blocks[i];
+            if (bp->flags & BLOCK_PAGE)
+                rescan_page(&markers[0], (page_t *) bp);
+            else if (is_marked(bp))
+                scan_block(&markers[0], bp);
+        }
+    }
 }
 
-/*** malloc ***/
+/*
+ * Rebuild the free list of a page from the marks on its slots and put the
+ * page back in its bin if it has room. Returns the number of live slots.
+ */
+static unsigned int sweep_page(page_t *pg)
+{
+    unsigned int units = class_units[pg->cls], live = 0, freed = 0;
+    header_t *first = (header_t *) pg + PAGE_HEADER_UNITS, *sp;
+
+    pg->free = NULL;
+    for (sp = pg->bump; (sp -= units) >= first;) {
+        if ((sp->flags & BLOCK_USED) && is_marked(sp)) {
+            live++;
+            continue;
+        }
+        if (sp->flags & BLOCK_USED)
+            freed++;
+        sp->flags = 0;
+        sp->next = pg->free;
+        pg->free = sp;
+    }
+    pg->live = live;
+    stats.live_blocks += live;
+    stats.live_bytes += live * units * sizeof(header_t);
+    stats.freed_blocks += freed;
+    stats.freed_bytes += freed * units * sizeof(header_t);
+
+    if (live > 0 && (pg->free != NULL ||
+                     pg->bump + units <= (header_t *) pg + pg->hdr.size)) {
+        pg->next_page = bins[pg->cls];
+        bins[pg->cls] = pg;
+    }
+    return live;
+}
 
 /*
- * Find a chunk from the free list and put it in the used list.
+ * Aim the next collection at the live size found by the sweep that just
+ * finished: it starts once gc_percent percent of that has been allocated.
  */
-void *gc_malloc(size_t alloc_size)
+static void update_trigger(void)
 {
-    size_t num_units;
-    header_t *p, *prevp;
+    trigger = stats.live_bytes / 100 * (gc_percent < 0 ? 0 : gc_percent);
+    if (trigger < MIN_TRIGGER)
+        trigger = MIN_TRIGGER;
+    heap_goal = stats.live_bytes + trigger;
+    stats.trigger_bytes = trigger;
+}
 
-    // Get malloc size in terms of 16 byte-chunks
-    // Note: (alloc_size + sizeof(header_t) - 1) ensures we obtain the right
-    //       unit size
-    num_units = (alloc_size + sizeof(header_t) - 1) / sizeof(header_t) + 1;
-    prevp = freep;
+/*
+ * Free a block found dead by the sweep. The sweep frees blocks in address
+ * order, so the search for the block's place on the free list starts where
+ * the last one went, rather than wherever gc_malloc() left freep in between.
+ * freep is put back afterwards, so that the next fit doesn't start over from
+ * the sweep and walk the holes it hasn't reached yet.
+ */
+static void sweep_free(header_t *bp)
+{
+    header_t *fitp = freep;
+    int absorbed = fitp == bp + bp->size;  // by forward coalescence
 
-    // Cycle through the list of free blocks, finding space to allocate
-    for (p = prevp->next;; prevp = p, p = p->next) {
-        if (p->size >= num_units) {  // big enough
-            if (p->size == num_units)  // exact size
-                prevp->next = p->next;
-            else {
-                p->size -= num_units;
-                p += p->size;
-                p->size = num_units;
-            }
+    if (sweep_hint != NULL)
+        freep = sweep_hint;
+    set_start(bp, 0);
+    add_to_free_list(bp);
+    sweep_hint = freep;
+    if (!absorbed)
+        freep = fitp;
+}
 
-            freep = prevp;  // next fit strategy
+/*
+ * Free the part of the nursery from gap up to end, young blocks that weren't
+ * marked and filler.
+ */
+static void free_gap(header_t *gap, header_t *end)
+{
+    gap->size = end - gap;
+    gap->flags = 0;
+    sweep_free(gap);
+}
 
-            // Add p to used list
-            if (usedp == NULL) usedp = p->next = p;
-            else {
-                p->next = usedp->next;
-                usedp->next = p;
+/*
+ * Promote the young blocks marked by the collection, minor or not, and free
+ * the rest of the nursery. A conservative collector can't move what it
+ * finds, so the survivors stay where they are and become ordinary blocks of
+ * the free list heap, while the space between them goes on the free list.
+ */
+static void promote_nursery(void)
+{
+    header_t *p, *end, *gap;
+    size_t i;
+
+    // In address order, so the gaps find their place on the free list
+    // right away
+    qsort(tlabs, num_tlabs, sizeof(tlab_t), compare_tlabs);
+    for (i = 0; i < num_tlabs; i++) {
+        end = tlabs[i].end;
+        gap = NULL;
+        for (p = tlabs[i].start; p < end; p += p->size) {
+            if (!(p->flags & BLOCK_YOUNG) || !is_marked(p)) {
+                if (p->flags & BLOCK_YOUNG)
+                    set_start(p, 0);
+                if (gap == NULL)
+                    gap = p;
+                continue;
             }
 
-            return (void *) (p + 1);
+            if (gap != NULL)
+                free_gap(gap, p);
+            gap = NULL;
+            p->flags &= ~BLOCK_YOUNG;
+            // Without room in the index the block is never swept, but it
+            // isn't freed either
+            if (reserve_block_index() == 0)
+                add_to_block_index(p);
+            stats.promoted_blocks++;
+            stats.promoted_bytes += p->size * sizeof(header_t);
         }
+        if (gap != NULL)
+            free_gap(gap, end);
+    }
+    num_tlabs = 0;
+    nursery_units = 0;
+}
 
-        if (p == freep) {  // not enough memory
-            p = more_core(num_units * sizeof(header_t));
-            if (p == NULL)  // request for more memory failed
-                return NULL;
+/*
+ * Sweep up to budget entries of the block index, freeing the blocks that
+ * weren't marked. Returns whether the sweep is complete.
+ */
+static int sweep_blocks(size_t budget)
+{
+    double start = now_ms();
+    header_t *bp;
+    size_t n;
+
+    for (; budget > 0 && sweep_pos < sweep_end; budget--) {
+        bp = blocks[sweep_pos++];
+        if (bp->flags & BLOCK_PAGE) {
+            if (sweep_page((page_t *) bp) > 0)
+                blocks[sweep_kept++] = bp;
+            else
+                sweep_free(bp);
+        } else if (is_marked(bp)) {
+            blocks[sweep_kept++] = bp;
+            stats.live_blocks++;
+            stats.live_bytes += bp->size * sizeof(header_t);
+        } else {
+            stats.freed_blocks++;
+            stats.freed_bytes += bp->size * sizeof(header_t);
+            sweep_free(bp);
         }
     }
+    stats.sweep_ms += now_ms() - start;
+    if (sweep_pos < sweep_end)
+        return 0;
+
+    // Close the gap left by the freed blocks, before the blocks appended
+    // since the collection, which may not follow on from them
+    n = num_blocks - sweep_end;
+    if (n > 0 && sweep_kept > 0 && blocks[sweep_end] < blocks[sweep_kept - 1])
+        blocks_sorted = 0;
+    memmove(&blocks[sweep_kept], &blocks[sweep_end], n * sizeof(header_t *));
+    num_blocks = sweep_kept + n;
+    sweeping = 0;
+
+    update_trigger();
+    release_empty_chunks();
+    if (!collecting)
+        end_collection();
+    return 1;
 }
 
-/*** mark and sweep ***/
+/*
+ * Start the sweep of a collection once everything is marked, and sweep the
+ * lot unless the sweep is lazy. Called with heap_lock held.
+ */
+static void start_sweep(void)
+{
+    size_t i;
+
+    // The survivors of the nursery join the blocks to sweep, and with every
+    // young block promoted, no old block points to one any more
+    promote_nursery();
+    clear_cards();
+
+    // Pages rejoin their bin as they are swept, and until then gc_malloc()
+    // carves new ones
+    for (i = 0; i < NUM_CLASSES; i++)
+        bins[i] = NULL;
+    sweeping = 1;
+    sweep_pos = sweep_kept = 0;
+    sweep_end = num_blocks;
+    sweep_hint = NULL;
+    sweep_step = LAZY_SWEEP_STEP;
+    if (!lazy_sweep)
+        sweep_blocks((size_t) -1);
+}
 
 /*
- * Scan a region of memory and mark any items in the used list if there exists
- * a pointer in the region that points to the item.
- *
- * Note: Both arguments must be word-aligned.
+ * Choose whether gc_collect() frees the unreachable blocks itself (the
+ * default) or only marks and leaves the sweep to the following gc_malloc()
+ * calls, so that the pause only depends on the amount of live memory.
  */
-static void scan_region(long *sp, long *end)
+void gc_set_lazy_sweep(int enabled)
 {
-    header_t *curr_used;
+    lazy_sweep = enabled;
+}
 
-    // Scan through the region 8 bytes (size of a pointer) at a time
-    for (; sp < end; sp++) {
-        long ptr = *sp;
-        curr_used = usedp;
+/*
+ * Choose how many threads mark in parallel during a collection, the calling
+ * thread included. The helpers are started by the next collection.
+ */
+void gc_set_mark_threads(int n)
+{
+    if (n < 1)
+        n = 1;
+    else if (n > MAX_MARK_THREADS)
+        n = MAX_MARK_THREADS;
+    pthread_mutex_lock(&heap_lock);
+    mark_threads = n;
+    pthread_mutex_unlock(&heap_lock);
+}
 
-        // Cycle through the used list. If the pointer (note: the value may not
-        // be a pointer, but we check anyway) points to an address that is
-        // within the used list, then the allocated space is still being used.
-        // So we mark the header.
-        do {
-            if ((long) (curr_used + 1) <= ptr &&
-                (long) (curr_used + curr_used->size) > ptr) {
-                    // Mark header
-                    curr_used->next = (header_t *) ((long) curr_used->next | 1);
-                    break;
-                }
-        } while ((curr_used = UNTAG(curr_used->next)) != usedp);
-    }
+/*
+ * Copy the collector's statistics into *out.
+ */
+void gc_stats(gc_stats_t *out)
+{
+    pthread_mutex_lock(&heap_lock);
+    update_heap_stats();
+    *out = stats;
+    pthread_mutex_unlock(&heap_lock);
 }
 
 /*
- * Scan the marked blocks for references to other unmarked blocks.
+ * Have fn called with the statistics at the end of every collection, once
+ * its sweep is done, and of every minor collection, or stop with a NULL fn.
+ * fn runs with the collector's lock held, possibly from within gc_malloc(),
+ * so it must not call into the collector.
  */
-static void scan_heap(void)
+void gc_set_trace(gc_trace_fn fn, void *arg)
 {
-    long *mem_block;
-    header_t *curr_used, *up;
-
-    // Cycle through the used list (i.e. the heap). For each member of the used
-    // list, if its header is marked, then we scan every 8-byte block of memory
-    // within the allocated space. If there is a pointer that points to some
-    // other member of the used list, then that space is still being used. So
-    // we mark the header.
-    curr_used = usedp;
-    do {
-        // Unmarked
-        if (!((long) curr_used->next & 1))
-            continue;
+    pthread_mutex_lock(&heap_lock);
+    trace_fn = fn;
+    trace_arg = arg;
+    pthread_mutex_unlock(&heap_lock);
+}
+
+static void add_marker_stats(void)
+{
+    int i;
+
+    for (i = 0; i < num_markers; i++)
+        if (young_only)
+            stats.minor_scanned_bytes += markers[i].root_bytes +
+                                         markers[i].heap_bytes;
+        else {
+            stats.root_bytes += markers[i].root_bytes;
+            stats.heap_bytes_scanned += markers[i].heap_bytes;
+        }
+}
+
+/*
+ * Mark everything reachable from the roots: the data segments and the stacks
+ * of every registered thread, and in a minor collection the dirty cards. The
+ * calling thread's callee-saved registers are spilled into this frame first
+ * and its stack is scanned from here up, so that pointers held only in
+ * registers are found too. With trace clear, at the start of a concurrent
+ * collection, only the roots themselves are scanned, and the blocks they
+ * point to are left grey for the background marker.
+ */
+static void __attribute__((noinline)) mark_from_roots(int trace)
+{
+    jmp_buf regs;
+    gc_thread_t *t;
+    long *from, *to;
+    int i;
+#ifdef __GLIBC__
+    extern char __data_start, end;  // provided by the linker
+#else
+    extern char etext, end;
+#endif
+
+#ifdef __GNUC__
+    __builtin_unwind_init();
+#endif
+    setjmp(regs);
+
+    num_roots = num_root_pieces = 0;
+    atomic_store(&next_root_piece, 0);
+    for (i = 0; i < num_markers; i++)
+        markers[i].root_bytes = markers[i].heap_bytes = 0;
+
+    // The BSS and initialized data segments. Where the linker marks the
+    // start of .data, the read-only sections in front of it are skipped
+    // since they can't hold heap pointers. etext isn't necessarily
+    // word-aligned, so round it up.
+#ifdef __GLIBC__
+    add_root((long *) &__data_start, (long *) &end);
+#else
+    add_root((long *) (((long) &etext + sizeof(long) - 1) &
+                       ~(sizeof(long) - 1)),
+             (long *) &end);
+#endif
 
-        // Marked
-        for (mem_block = (long *) (curr_used + 1);
-             mem_block < (long *) (curr_used + curr_used->size);
-             mem_block++) {
-            long ptr = *mem_block;
-            up = UNTAG(curr_used->next);
-            do {
-                if (up != curr_used &&
-                    (long) (up + 1) <= ptr &&
-                    (long) (up + up->size) > ptr) {
-                    up->next = (header_t *) ((long) up->next | 1);
-                    break;
-                }
-            } while ((up = UNTAG(up->next)) != curr_used);
+    // The stacks
+    for (t = threads; t != NULL; t = t->next)
+        if (t == self && t->stack_bottom != NULL)
+            add_root((long *) regs, t->stack_bottom);
+        else if (t->stack_top != NULL && t->stack_bottom != NULL)
+            add_root(t->stack_top, t->stack_bottom);
+
+    if (young_only)
+        add_dirty_cards();
+
+    if (!trace) {
+        while (claim_root_piece(&from, &to)) {
+            scan_region(&markers[0], from, to);
+            markers[0].root_bytes += (char *) to - (char *) from;
         }
-    } while ((curr_used = UNTAG(curr_used->next)) != usedp);
+        return;
+    }
+
+    scan_heap();
+    add_marker_stats();
+}
+
+/*
+ * Choose when gc_malloc() collects by itself: once the bytes allocated since
+ * the last collection reach percent percent of what that collection found
+ * live, like GOGC. The default is 100, which lets the heap grow to about
+ * twice the live size. A negative percent turns automatic collection off.
+ */
+void gc_set_gc_percent(int percent)
+{
+    pthread_mutex_lock(&heap_lock);
+    gc_percent = percent;
+    if (!sweeping)
+        update_trigger();
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/*
+ * Choose by how much the heap grows when it runs out of space, as a
+ * percentage of its size. The default is 50.
+ */
+void gc_set_heap_growth(int percent)
+{
+    pthread_mutex_lock(&heap_lock);
+    heap_growth = percent < 0 ? 0 : percent;
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/*
+ * Choose whether small blocks are allocated in a nursery and collected apart
+ * from the rest of the heap, most of them being short-lived. Minor
+ * collections of the nursery only scan the blocks that old blocks were made
+ * to point to through gc_write_barrier(), so every pointer stored in a heap
+ * block must go through it while this is on. gc_collect() collects
+ * everything as before. Turning it off leaves the nursery's blocks for the
+ * next gc_collect() to promote.
+ */
+void gc_set_generational(int enabled)
+{
+    pthread_mutex_lock(&heap_lock);
+    generational = enabled;
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/*
+ * Store value in *field, a pointer within the block obj that gc_malloc()
+ * returned. During a concurrent mark, the block that *field pointed to is
+ * shaded first. Stores into young blocks need no other record. Otherwise
+ * the card of the field is marked dirty, so that the next minor collection
+ * scans it for pointers to young blocks.
+ */
+void gc_write_barrier(void *obj, void **field, void *value)
+{
+    header_t *bp = (header_t *) obj - 1;
+    chunk_t *cp;
+
+    if (marking) {
+        if (self == NULL)
+            gc_register_thread();
+        if (self != NULL)
+            satb_log(self, *field);
+    }
+    *field = value;
+    if (bp->flags & BLOCK_YOUNG)
+        return;
+    if ((cp = find_chunk(field)) != NULL)
+        cp->cards[((char *) field - (char *) cp->start) / CARD_SIZE] = 1;
+}
+
+/*
+ * Choose whether collections mark concurrently: the world is only stopped
+ * to scan the roots, and again at the end to finish the mark, while a
+ * background thread marks the rest as the program runs. Every pointer
+ * stored in a heap block must go through gc_write_barrier() while this is
+ * on. An automatic collection returns as soon as the mark has started,
+ * gc_collect() waits for the collection to finish.
+ */
+void gc_set_concurrent(int enabled)
+{
+    pthread_mutex_lock(&heap_lock);
+    concurrent = enabled;
+    pthread_mutex_unlock(&heap_lock);
 }
 
 /*
@@ -197,62 +2286,306 @@ static void scan_heap(void)
  */
 void gc_collect(void)
 {
-    header_t *p, *prevp, *tp;
-    // unsigned long stack_top;
-    extern char end, etext;  // provided by the linker
+    collect(0);
+}
+
+/*
+ * Wait for the concurrent collection under way to finish. Called with
+ * heap_lock held.
+ */
+static void wait_for_cycle(void)
+{
+    unsigned long cycle = cycles_done;
+
+    while (cycles_done == cycle)
+        pthread_cond_wait(&cycle_cond, &heap_lock);
+}
 
-    if (usedp == NULL) return;
+/*
+ * Finish a concurrent mark with the world stopped: scan the blocks that
+ * the threads shaded since they last handed them over, and whatever is
+ * still grey, then sweep as gc_collect() does. The roots need no second
+ * look, whatever they point to now was either reachable when the mark
+ * started or allocated marked since.
+ */
+static void remark(double concurrent_ms)
+{
+    double start;
+    gc_thread_t *t;
+    size_t i;
 
-    // Scan the BSS and initialized data segments
-    scan_region((long *) &etext, (long *) &end);
+    pthread_mutex_lock(&heap_lock);
+    start = now_ms();
+    collecting = 1;
+    stats.concurrent_ms = concurrent_ms;
 
-    // Scan the stack
+    // qsort() may call malloc, so sort while nobody is stopped
+    sort_block_index();
+    stop_world();
 
-    // Scan the heap
+    for (t = threads; t != NULL; t = t->next) {
+        for (i = 0; i < NUM_CLASSES; i++)
+            t->pages[i] = NULL;
+        retire_tlab(t);
+        for (i = 0; i < t->satb_len; i++)
+            if (deque_push(&markers[0], t->satb[i]) == -1)
+                atomic_store(&mark_overflow, 1);
+        t->satb_len = 0;
+    }
+    drain_grey(&markers[0]);
     scan_heap();
+    marking = 0;
 
-    // Collection
-    for (prevp = usedp, p = UNTAG(usedp->next);; prevp = p, p = UNTAG(p->next)) {
-    next_chunk:
-        if (!((long) p->next & 1)) {
-            // The chunk hasn't been marked. Thus, it must be set free. 
-            tp = p;
-            p = UNTAG(p->next);
-            add_to_free_list(tp);
-
-            if (usedp == tp) { 
-                usedp = NULL;
-                break;
-            }
+    resume_world();
+    stats.mark_ms += now_ms() - start;
+    add_marker_stats();
+    start_sweep();
 
-            prevp->next = (header_t *) ((long) p | ((long) prevp->next & 1));
-            goto next_chunk;
-        }
-        p->next = (header_t *) ((long) p->next & ~1);
-        if (p == usedp)
-            break;
+    stats.remark_ms = now_ms() - start;
+    stats.pause_ms += stats.remark_ms;
+    record_pause(stats.remark_ms);
+    collecting = 0;
+    cycles_done++;
+    pthread_cond_broadcast(&cycle_cond);
+    if (!sweeping)
+        end_collection();
+
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/*
+ * The background marker, which blocks every signal like the helpers do. It
+ * marks from the grey blocks that the first pause left, and those handed
+ * over by the write barrier, until it runs out of both.
+ */
+static void *concurrent_main(void *arg)
+{
+    double start;
+
+    (void) arg;
+    for (;;) {
+        while (sem_wait(&concurrent_go) != 0)
+            ;
+        start = now_ms();
+        do
+            mark_parallel();
+        while (drain_grey(&markers[0]));
+        remark(now_ms() - start);
+    }
+    return NULL;
+}
+
+/*
+ * Start a concurrent collection: scan the roots with the world stopped, and
+ * leave the rest of the mark to the background marker. Returns -1 if the
+ * marker can't be started. Called with heap_lock held.
+ */
+static int start_concurrent(double start)
+{
+    sigset_t mask, old;
+    pthread_t id;
+    double stop;
+    int err;
+
+    if (!concurrent_started) {
+        sigfillset(&mask);
+        pthread_sigmask(SIG_BLOCK, &mask, &old);
+        err = pthread_create(&id, NULL, concurrent_main, NULL);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        if (err != 0)
+            return -1;
+        pthread_detach(id);
+        concurrent_started = 1;
+    }
+    start_helpers();
+
+    stop = now_ms();
+    stop_world();
+    mark_from_roots(0);
+    marking = 1;
+    resume_world();
+
+    stats.mark_ms = now_ms() - stop;
+    stats.pause_ms = now_ms() - start;
+    record_pause(stats.pause_ms);
+    sem_post(&concurrent_go);
+    return 0;
+}
+
+/*
+ * Collect, or with if_due set, only if it's time for an automatic
+ * collection, which another thread may have just done.
+ */
+static void collect(int if_due)
+{
+    double start = now_ms(), stop;
+    gc_thread_t *t;
+    size_t i;
+
+    if (self == NULL) {
+        gc_register_thread();
+        if (self == NULL)
+            return;
+    }
+
+    pthread_mutex_lock(&heap_lock);
+    if (if_due && !collection_due()) {
+        pthread_mutex_unlock(&heap_lock);
+        return;
     }
+    if (marking) {  // a concurrent collection is under way
+        wait_for_cycle();
+        pthread_mutex_unlock(&heap_lock);
+        return;
+    }
+
+    // The marks of the last collection are needed until its sweep is done
+    if (sweeping)
+        sweep_blocks((size_t) -1);
+    clear_marks();
+    allocated = 0;
+
+    if (num_blocks == 0 && num_tlabs == 0) {
+        pthread_mutex_unlock(&heap_lock);
+        return;
+    }
+
+    collecting = 1;
+    stats.collections++;
+    stats.mark_ms = stats.sweep_ms = 0;
+    stats.concurrent_ms = stats.remark_ms = 0;
+    stats.root_bytes = stats.heap_bytes_scanned = 0;
+    stats.live_bytes = stats.live_blocks = 0;
+    stats.freed_bytes = stats.freed_blocks = 0;
+    stats.promoted_bytes = stats.promoted_blocks = 0;
+
+    if (concurrent && start_concurrent(start) == 0) {
+        collecting = 0;
+        if (!if_due)
+            wait_for_cycle();
+        pthread_mutex_unlock(&heap_lock);
+        return;
+    }
+
+    // qsort() may call malloc, and so may starting threads, so do both
+    // while nobody is stopped
+    sort_block_index();
+    start_helpers();
+
+    stop = now_ms();
+    stop_world();
+
+    // Take every thread's pages and nursery space away. The sweep puts the
+    // pages with room back in the bins, and the threads refill from there.
+    for (t = threads; t != NULL; t = t->next) {
+        for (i = 0; i < NUM_CLASSES; i++)
+            t->pages[i] = NULL;
+        retire_tlab(t);
+    }
+
+    mark_from_roots(1);
+
+    // The threads only need the heap lock from here on
+    resume_world();
+    stats.mark_ms = now_ms() - stop;
+    start_sweep();
+
+    stats.pause_ms = now_ms() - start;
+    record_pause(stats.pause_ms);
+    collecting = 0;
+    if (!sweeping)
+        end_collection();
+
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/*
+ * Collect the nursery alone, once it's full. Only the roots, the dirty cards
+ * and the young blocks they reach are scanned, so the pause depends on how
+ * much of the nursery survives rather than on the size of the heap.
+ */
+static void minor_collect(void)
+{
+    double start = now_ms();
+    gc_thread_t *t;
+
+    pthread_mutex_lock(&heap_lock);
+    if (nursery_units < NURSERY_SIZE / sizeof(header_t) || marking) {
+        // Another thread got there first, or a concurrent mark is under way
+        pthread_mutex_unlock(&heap_lock);
+        return;
+    }
+
+    stats.minor_collections++;
+    stats.minor_scanned_bytes = 0;
+    stats.promoted_bytes = stats.promoted_blocks = 0;
+    start_helpers();
+
+    // Blocks in the nursery were all free memory at the last collection, so
+    // their marks are clear. The marks of the old blocks are left alone for
+    // a pending sweep.
+    stop_world();
+    for (t = threads; t != NULL; t = t->next)
+        retire_tlab(t);
+    young_only = 1;
+    mark_from_roots(1);
+    young_only = 0;
+
+    // Nobody can allocate a young block until the heap lock is released
+    resume_world();
+    promote_nursery();
+
+    // Promoted blocks count as allocated, towards the next full collection
+    allocated += stats.promoted_bytes;
+
+    stats.minor_pause_ms = now_ms() - start;
+    record_pause(stats.minor_pause_ms);
+    end_collection();
+
+    pthread_mutex_unlock(&heap_lock);
 }
 
 /*** main ***/
 
 /*
- * Initialization.
+ * Initialization. Runs once, from the first gc_register_thread().
  */
 static void initialize()
 {
+    struct sigaction sa;
+
+    sem_init(&stop_ack, 0, 0);
+    sem_init(&mark_done, 0, 0);
+    sem_init(&concurrent_go, 0, 0);
+    pthread_key_create(&thread_key, thread_exit);
+
+    // Everything stays blocked in the suspend handler, except for the resume
+    // signal it waits for
+    sigfillset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sa.sa_handler = suspend_handler;
+    sigaction(GC_SIG_SUSPEND, &sa, NULL);
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = resume_handler;
+    sigaction(GC_SIG_RESUME, &sa, NULL);
+
+    stats.trigger_bytes = trigger;
     more_core(MIN_ALLOC_SIZE);
 }
 
+// Leave the demo out when the collector is built into another program, like
+// gc_bench.c
+#ifndef GC_NO_MAIN
 int main()
 {
-    initialize();
+    gc_register_thread();
 
     printf("freep: %p\n", freep);
     printf("freep->next: %p\n", freep->next);
     printf("freep->next->next: %p\n", freep->next->next);
 
     int *p1, *p2, *p3;
+    gc_stats_t st;
 
     printf("Malloc 1: %p\n", p1 = gc_malloc(16));
     printf("Malloc 2: %p\n", p2 = gc_malloc(4080));
@@ -265,5 +2598,12 @@ int main()
     printf("freep->next->next: %p\n", freep->next->next);
     printf("freep->next->next->next: %p\n", freep->next->next->next);
 
+    gc_stats(&st);
+    printf("Collections: %lu, pause %.3f ms (mark %.3f ms, sweep %.3f ms)\n",
+           st.collections, st.pause_ms, st.mark_ms, st.sweep_ms);
+    printf("Live: %zu blocks, %zu bytes; freed: %zu blocks, %zu bytes\n",
+           st.live_blocks, st.live_bytes, st.freed_blocks, st.freed_bytes);
+
     return 0;
 }
+#endif
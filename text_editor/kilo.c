@@ -7,21 +7,52 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef KILO_GC
+#include "gc.h"
+#endif
+
 /*** defines ***/
 
 #define KILO_VERSION "0.0.1"
 #define KILO_TAB_STOP 4
 #define KILO_QUIT_TIMES 3
+#define KILO_MMAP_MIN (1 << 20)  /* files this big are mapped and loaded lazily */
+#define KILO_LINE_CHECK 64  /* lines between offsets kept by the line index */
+#define KILO_INDEX_BATCH 65536  /* lines indexed between two updates */
+#define KILO_RENDER_CACHE (4 << 20)  /* bytes of renders kept for old rows */
+#define KILO_RX_CHECK 256  /* chars between the rx kept for rows with tabs */
+#define KILO_HL_FRAME (1 << 20)  /* bytes lexed before a frame, for the rows
+                                    it shows */
+#define KILO_HL_SLICE (4 << 20)  /* bytes lexed in a slice of idle time */
+#define KILO_SEARCH_CHUNK (1 << 20)  /* bytes searched between two updates */
+#define KILO_SAVE_CHUNK (8 << 20)  /* bytes saved between two updates */
+#define KILO_SAVE_IOV 64  /* buffers handed to one writev() */
+#define KILO_SEARCH_WAIT 20  /* ms a search is waited for before it goes on
+                                 in the background */
+#define KILO_INPUT_BUF 4096  /* bytes of input read at once */
+#define KILO_UNDO_MAX (16 << 20)  /* bytes of undo history kept, unless the
+                                     KILO_UNDO_MAX environment variable says */
+#define KILO_STATUS_TIME 5  /* seconds a status message is shown for */
+#define KILO_BENCH_MB 64  /* size of the file --bench makes, unless given */
+#define KILO_BENCH_KEYS 20000  /* keys --bench replays */
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 
@@ -35,18 +66,141 @@ enum editorKey {
     HOME_KEY,
     END_KEY,
     PAGE_UP,
-    PAGE_DOWN
+    PAGE_DOWN,
+    PASTE_START,
+    PASTE_END
+};
+
+enum editorTimerId {
+    TIMER_STATUS,
+    TIMER_COUNT
+};
+
+enum editorHighlight {
+    HL_NORMAL = 0,
+    HL_COMMENT,
+    HL_MLCOMMENT,
+    HL_KEYWORD1,
+    HL_KEYWORD2,
+    HL_STRING,
+    HL_NUMBER
 };
 
 /*** data ***/
 
+/* The render is made when the row is drawn or searched, rsize is -1 until
+ * then and again once the row is edited. Rows without tabs render as their
+ * chars, with no render of their own. Their rx is their cx, rows with tabs
+ * keep the rx of every KILO_RX_CHECK-th char, to convert from there. The
+ * highlight is made when the row is drawn, and goes with the render. */
 typedef struct erow {
     int size;
     int rsize;
     char *chars;
     char *render;
+    unsigned char *hl;  /* the HL_ class of each render char, or NULL */
+    int hllen;  /* render chars hl is made for, those up to the screen edge */
+    int hlstate, hlopen;  /* the lexer state hl is from, and the one at the
+                             end of the row */
+    struct erow *lruprev, *lrunext;  /* rows with a render or hl of their own */
+    int tabs;  /* -1 until counted */
+    int *rxcheck;
+    int rxchecks;  /* entries of rxcheck that are up to date */
 } erow;
 
+/* Rows live in the nodes of an implicit treap, ordered by position in the
+ * file, so that a row is found, inserted or deleted in O(log n). The row
+ * comes first so that an erow pointer is also a pointer to its node, and it
+ * doesn't move while other rows come and go. A node can also be a span of
+ * lines of a mapped file that haven't been loaded into rows yet. */
+typedef struct rownode {
+    erow row;
+    struct rownode *left, *right, *parent;
+    int count;  /* rows in this subtree */
+    unsigned int prio;
+    int span;  /* -1 for a loaded row, else the file lines the node holds */
+    int first;  /* first of those lines */
+
+    /* The lexer states at the start and the end of the node, hlout being -1
+     * while it has to be lexed again. hldirty says whether any node in the
+     * subtree has to be. */
+    signed char hlin, hlout;
+    int hldirty;
+} rownode;
+
+struct shadowLine {
+    char *b;
+    int len;
+    int cap;
+};
+
+enum undoType {
+    UNDO_INSERT,
+    UNDO_DELETE
+};
+
+/* One edit: text inserted or deleted at char x of row y, a '\n' in it being
+ * a line break. Typing a run of chars, or deleting one, makes one record. */
+struct undoOp {
+    int type;
+    int y, x;
+    size_t text;  /* where its text is in the undo arena, see undobase */
+    int len;
+    int newrow;  /* whether the edit added a row at the end first */
+    int breaks;  /* whether its text has a '\n', so no char is added to it */
+    int cy, cx;  /* the cursor before the edit */
+};
+
+/* Where the memory of rows comes from: their nodes, chars, renders and rx
+ * checkpoints, and the arrays of nodes the tree is built from. Memory that
+ * may point to more of it comes from alloc, the rest from allocText, so
+ * that a collector knows what to scan. Picked with KILO_ALLOC. */
+struct editorAllocator {
+    const char *name;
+    void *(*alloc)(size_t size);
+    void *(*allocText)(size_t size);
+    void *(*realloc)(void *p, size_t size);
+    void (*free)(void *p);
+};
+
+/* How the files of a type are highlighted. The lexer state carried from a
+ * row to the next is whether a multi-line comment is open. */
+struct editorSyntax {
+    char *filetype;
+    char **filematch;
+    char **keywords;  /* those ending in '|' are types */
+    char *singleline_comment_start;
+    char *multiline_comment_start;
+    char *multiline_comment_end;
+};
+
+/* Something to be done at a set time, from the event loop. */
+struct editorTimer {
+    long long at;  /* editorNanos() to fire at, 0 when not set */
+    void (*fire)(void);
+};
+
+/* A stretch of consecutive rows of a snapshot, as text with a '\n' between
+ * rows: either lines of the mapped file, or loaded rows copied out of the
+ * tree, which have a '\n' after the last one too. */
+struct snapshotPiece {
+    char *s, *end;
+    int at;  /* the first of its rows */
+    int rows;
+    int first;  /* the file line of s, or -1 for copied rows */
+};
+
+/* The rows as they were at some point, for another thread to read while
+ * the tree changes under the main one. */
+struct snapshot {
+    struct snapshotPiece *pieces;
+    int numpieces;
+    char *text;  /* the copied rows */
+    int rows;
+    int tail;  /* piece the lines still to be indexed go before, or -1 */
+    int loaded;  /* lines that were indexed, if so */
+};
+
 struct editorConfig {
     int cx, cy;
     int rx;
@@ -55,21 +209,162 @@ struct editorConfig {
     int screenrows;
     int screencols;
     int numrows;
-    erow *row;
+    rownode *rows;
+    const struct editorAllocator *alloc;
+
+    /* A mapped file and the index of its lines, built by another thread */
+    char *map;
+    size_t mapsize;
+    int mapfd;  /* kept open, so the file can be copied from once renamed over */
+    size_t *linecheck;  /* offset of every KILO_LINE_CHECK-th line */
+    int indexed;  /* lines indexed so far */
+    int indexdone;
+    int loaded;  /* indexed lines that are in the rows */
+    rownode *loader;  /* span the lines still being indexed are added to */
+    pthread_t indexer;
+    pthread_mutex_t indexlock;
+    pthread_cond_t indexcond;
+
+    erow *lruhead, *lrutail;  /* most and least recently rendered */
+    size_t renderbytes;
+    size_t rowbytes;  /* held by the loaded rows and their nodes */
+
+    /* Highlighting, see the syntax highlighting section */
+    struct editorSyntax *syntax;  /* NULL when the file isn't highlighted */
+    unsigned char *hlblock;  /* the states each KILO_LINE_CHECK lines of the
+                                mapped file lead to, 0 until lexed */
+    long hlbudget;  /* bytes left to lex before stopping */
+    struct {
+        rownode *node;
+        int first, in;
+        int lines, state;
+    } hlspan;  /* how far lexing a span got, to go on from there */
+    int stale;  /* whether idle work found the screen highlighted wrong */
+
+    /* The last frame as the terminal shows it, so that the next one only
+     * sends what changed. NULL until the first frame. */
+    struct shadowLine *shadow;
+    int shadowrowoff, shadowcoloff;
+
+    /* Scratch memory for the frame being drawn, see editorScratch() */
+    char *scratch;
+    size_t scratchlen, scratchcap;
+    size_t scratchneed;  /* the most the frame asked for */
+    void *scratchextra;  /* blocks for what didn't fit, in a list */
+
+    /* The rows matching the search query, in order, so that going to the
+     * next match is O(1) and a longer query only checks these again. They
+     * are found by another thread, which locks searchlock to add to hits. */
+    char *query;
+    int querytabs;  /* whether tabs can match, as the query has a space */
+    int *hits;
+    int numhits, hitcap;
+    int hitrows;  /* rows searched so far */
+    int hit;  /* the match the cursor is on, -1 for none yet */
+    int searchdone;
+    int searchcancel;
+    int seenhits, seenrows;  /* what the last frame showed */
+
+    /* What the search thread works on, left alone until it is joined */
+    int searching;
+    struct snapshot searchsnap;
+    int *oldhits;  /* the hits of a shorter query, to check again */
+    int numold;
+    int oldrows;  /* rows searched before, not to be searched again */
+    pthread_t searcher;
+    pthread_mutex_t searchlock;
+    pthread_cond_t searchcond;
+
+    /* A save going on in the background, writing savesnap to savepath */
+    int saving;
+    struct snapshot savesnap;
+    char *savepath;
+    char *savetarget;  /* the file written over, past any symlinks */
+    int savefd;
+    int savedirty;  /* dirty when the snapshot was taken */
+    size_t savebytes, savetotal;  /* written so far, and to write */
+    int savedone, saveerrno;
+    pthread_t saver;
+    pthread_mutex_t savelock;
+
+    /* The edits that can be undone, undo[undofirst] to undo[undonext - 1],
+     * then those that can be redone, up to undo[undoend - 1]. Their texts
+     * are in one arena, in the same order, so the oldest are dropped from
+     * the front once the history is over undomax bytes, and the ones that
+     * can't be redone any more from the back. */
+    struct undoOp *undo;
+    int undofirst, undonext, undoend, undocap;
+    char *undotext;
+    size_t undobase;  /* where undotext[0] is counted from */
+    size_t undolen, undotextcap;
+    size_t undomax;
+    int undoseal;  /* whether the next edit starts a record of its own */
+    int undoing;  /* set while an edit is undone or redone */
+
+    /* Input read ahead of the keys decoded from it, so that the bytes of a
+     * burst of keys or of a paste come in with one read() */
+    char inbuf[KILO_INPUT_BUF];
+    int inpos, inlen;
+
+    /* The event loop is woken by a byte on wakefd, written by the other
+     * threads when they have something to show, and on SIGWINCH */
+    int wakefd[2];
+    struct editorTimer timers[TIMER_COUNT];
+    int idle;  /* whether there may be idle work to do */
+
+    /* What the stats overlay shows, toggled with Ctrl-T */
+    int showstats;
+    long long framens;  /* taken to build the last frame */
+    int framebytes;  /* written for it */
+    long inreads, inkeys;  /* read() calls that got input, and keys decoded */
+
     int dirty;
     char *filename;
     char statusmsg[80];
-    time_t statusmsg_time;
     struct termios orig_termios;
 };
 
 struct editorConfig E;
 
+volatile sig_atomic_t winchanged;
+
+/*** filetypes ***/
+
+char *C_HL_extensions[] = {".c", ".h", ".cpp", ".cc", ".hpp", NULL};
+char *C_HL_keywords[] = {
+    "switch", "if", "while", "for", "break", "continue", "return", "else",
+    "struct", "union", "typedef", "static", "enum", "class", "case", "const",
+    "do", "goto", "sizeof", "default", "extern", "volatile",
+
+    "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
+    "void|", "short|", "size_t|", NULL
+};
+
+struct editorSyntax HLDB[] = {
+    {
+        "c",
+        C_HL_extensions,
+        C_HL_keywords,
+        "//", "/*", "*/"
+    },
+};
+
+#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+
 /*** prototypes ***/
 
 void editorSetStatusMessage(const char *fmt, ...);
+void editorWake();
+void editorInputWait();
+void editorTimerSet(int id, int ms, void (*fire)(void));
+void editorStatusExpire();
+void editorUpdateWindowSize();
+int editorIndexPoll();
+int editorSearchPoll();
+int editorSavePoll();
 void editorRefreshScreen();
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+void editorUndoRecord(int type, int y, int x, char *s, int len, int newrow);
 
 /*** terminal ***/
 
@@ -82,6 +377,7 @@ void die(const char *s) {
 }
 
 void disableRawMode() {
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
         die("tcsetattr");
 }
@@ -99,33 +395,61 @@ void enableRawMode() {
     raw.c_cc[VTIME] = 1;
 
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+
+    /* Pastes come between "\x1b[200~" and "\x1b[201~", to go in at once */
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
+}
+
+/* The next byte of input, if one comes before the read times out. */
+int editorInputByte(char *c) {
+    if (E.inpos == E.inlen) {
+        int nread = read(STDIN_FILENO, E.inbuf, sizeof(E.inbuf));
+        if (nread <= 0) return 0;
+        E.inpos = 0;
+        E.inlen = nread;
+        E.inreads++;
+    }
+    *c = E.inbuf[E.inpos++];
+    return 1;
+}
+
+/* Whether keys were read that are still to be processed. */
+int editorInputPending() {
+    return E.inpos < E.inlen;
 }
 
 int editorReadKey() {
-    int nread;
     char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-        if (nread == -1 && errno != EAGAIN) die("read");
-    }
+    editorInputWait();
+    editorInputByte(&c);
+    E.inkeys++;
 
     if (c == '\x1b') {
-        char seq[3];
+        char seq[2];
 
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+        if (!editorInputByte(&seq[0])) return '\x1b';
+        if (!editorInputByte(&seq[1])) return '\x1b';
 
         if (seq[0] == '[') {
             if (seq[1] >= '0' && seq[1] <= '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
-                if (seq[2] == '~') {
-                    switch (seq[1]) {
-                        case '1': return HOME_KEY;
-                        case '3': return DEL_KEY;
-                        case '4': return END_KEY;
-                        case '5': return PAGE_UP;
-                        case '6': return PAGE_DOWN;
-                        case '7': return HOME_KEY;
-                        case '8': return END_KEY;
+                int n = seq[1] - '0';
+                char end;
+                while (1) {
+                    if (!editorInputByte(&end)) return '\x1b';
+                    if (end < '0' || end > '9') break;
+                    n = n * 10 + end - '0';
+                }
+                if (end == '~') {
+                    switch (n) {
+                        case 1: return HOME_KEY;
+                        case 3: return DEL_KEY;
+                        case 4: return END_KEY;
+                        case 5: return PAGE_UP;
+                        case 6: return PAGE_DOWN;
+                        case 7: return HOME_KEY;
+                        case 8: return END_KEY;
+                        case 200: return PASTE_START;
+                        case 201: return PASTE_END;
                     }
                 }
             } else {
@@ -182,12 +506,542 @@ int getWindowSize(int *rows, int *cols) {
     }
 }
 
+/*** allocators ***/
+
+/* The pool serves blocks of up to 4 KB from slabs, in classes of powers of
+ * two with a free list each, so that rows coming and going never reach
+ * malloc, and a row growing a char at a time only moves when it doubles.
+ * A header before each block keeps how much it can hold. Bigger blocks
+ * come from malloc, with the same header. Slabs are kept for good. Only
+ * the main thread allocates rows, so there is no locking. */
+#define POOL_CLASSES 9  /* 16 to 4096 bytes, with the header */
+#define POOL_SLAB (256 << 10)
+
+struct {
+    void *free[POOL_CLASSES];
+    char *bump, *end;
+} pool;
+
+int poolClass(size_t bytes) {
+    int cls = 0;
+    while (((size_t)16 << cls) < bytes) cls++;
+    return cls;
+}
+
+void *poolAlloc(size_t size) {
+    size_t bytes = size + sizeof(size_t);
+    size_t *h;
+
+    if (bytes > (size_t)16 << (POOL_CLASSES - 1)) {
+        h = malloc(bytes);
+        if (h == NULL) return NULL;
+        *h = size;
+        return h + 1;
+    }
+
+    int cls = poolClass(bytes);
+    bytes = (size_t)16 << cls;
+    if (pool.free[cls]) {
+        h = pool.free[cls];
+        pool.free[cls] = *(void **)h;
+    } else {
+        if ((size_t)(pool.end - pool.bump) < bytes) {
+            pool.bump = malloc(POOL_SLAB);
+            if (pool.bump == NULL) return NULL;
+            pool.end = pool.bump + POOL_SLAB;
+        }
+        h = (size_t *)pool.bump;
+        pool.bump += bytes;
+    }
+    *h = bytes - sizeof(size_t);
+    return h + 1;
+}
+
+void poolFree(void *p) {
+    if (p == NULL) return;
+    size_t *h = (size_t *)p - 1;
+    size_t bytes = *h + sizeof(size_t);
+
+    if (bytes > (size_t)16 << (POOL_CLASSES - 1)) {
+        free(h);
+        return;
+    }
+    int cls = poolClass(bytes);
+    *(void **)h = pool.free[cls];
+    pool.free[cls] = h;
+}
+
+void *poolRealloc(void *p, size_t size) {
+    if (p == NULL) return poolAlloc(size);
+    size_t *h = (size_t *)p - 1;
+    size_t cap = *h;
+    if (size <= cap) return p;
+
+    size_t big = ((size_t)16 << (POOL_CLASSES - 1)) - sizeof(size_t);
+    if (cap > big) {
+        h = realloc(h, size + sizeof(size_t));
+        if (h == NULL) return NULL;
+        *h = size;
+        return h + 1;
+    }
+    void *new = poolAlloc(size);
+    if (new == NULL) return NULL;
+    memcpy(new, p, cap);
+    poolFree(p);
+    return new;
+}
+
+#ifdef KILO_GC
+/* The collector frees what nothing points to any more. */
+void gcFree(void *p) {
+    (void)p;
+}
+#endif
+
+const struct editorAllocator editorAllocators[] = {
+    {"pool", poolAlloc, poolAlloc, poolRealloc, poolFree},
+    {"malloc", malloc, malloc, realloc, free},
+#ifdef KILO_GC
+    {"gc", gc_malloc, gc_malloc_atomic, gc_realloc, gcFree},
+#endif
+};
+
+#define NUM_ALLOCATORS \
+    (int)(sizeof(editorAllocators) / sizeof(editorAllocators[0]))
+
+/* The allocator named by KILO_ALLOC, the pool if it is unset. */
+void editorPickAllocator() {
+    char *name = getenv("KILO_ALLOC");
+    int k;
+
+    E.alloc = &editorAllocators[0];
+    if (name == NULL) return;
+    for (k = 0; k < NUM_ALLOCATORS; k++) {
+        if (strcmp(name, editorAllocators[k].name) == 0) {
+            E.alloc = &editorAllocators[k];
+            return;
+        }
+    }
+    fprintf(stderr, "kilo: no allocator %s, there is", name);
+    for (k = 0; k < NUM_ALLOCATORS; k++)
+        fprintf(stderr, " %s", editorAllocators[k].name);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+/* size bytes of scratch memory for the frame being drawn. It all goes when
+ * the next frame starts, and its block is grown to fit the most a frame
+ * has needed, so that drawing soon asks malloc for nothing. */
+void *editorScratch(size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    E.scratchneed += size;
+    if (E.scratchlen + size <= E.scratchcap) {
+        void *p = E.scratch + E.scratchlen;
+        E.scratchlen += size;
+        return p;
+    }
+
+    /* Until then, what doesn't fit gets a block of its own */
+    void **block = malloc(16 + size);
+    *block = E.scratchextra;
+    E.scratchextra = block;
+    return (char *)block + 16;
+}
+
+void editorScratchReset() {
+    while (E.scratchextra) {
+        void **block = E.scratchextra;
+        E.scratchextra = *block;
+        free(block);
+    }
+    if (E.scratchneed > E.scratchcap) {
+        free(E.scratch);
+        E.scratchcap = E.scratchneed * 2;
+        E.scratch = malloc(E.scratchcap);
+    }
+    E.scratchlen = 0;
+    E.scratchneed = 0;
+}
+
+/*** row index ***/
+
+int rowTreeCount(rownode *t) {
+    return t ? t->count : 0;
+}
+
+/* Rows held by t itself, not counting its subtrees. */
+int rowTreeOwn(rownode *t) {
+    return t->span < 0 ? 1 : t->span;
+}
+
+void rowTreeUpdate(rownode *t) {
+    t->count = rowTreeCount(t->left) + rowTreeCount(t->right) + rowTreeOwn(t);
+    t->hldirty = (t->span != 0 && t->hlout < 0) ||
+                 (t->left && t->left->hldirty) ||
+                 (t->right && t->right->hldirty);
+    if (t->left) t->left->parent = t;
+    if (t->right) t->right->parent = t;
+}
+
+rownode *rowNodeSpan(int first, int span) {
+    rownode *t = E.alloc->alloc(sizeof(rownode));
+    t->left = t->right = t->parent = NULL;
+    t->prio = rand();
+    t->span = span;
+    t->first = first;
+    t->hlin = t->hlout = -1;
+    rowTreeUpdate(t);
+    return t;
+}
+
+rownode *rowTreeMerge(rownode *l, rownode *r);
+
+/* Split t into its first at rows, in *l, and the rest, in *r. An empty span
+ * right at the split goes to *r, so that the lines still to be indexed come
+ * after any row inserted where they will go. */
+void rowTreeSplit(rownode *t, int at, rownode **l, rownode **r) {
+    if (t == NULL) {
+        *l = *r = NULL;
+        return;
+    }
+
+    int left = rowTreeCount(t->left);
+    int own = rowTreeOwn(t);
+    if (at > left + own || (own > 0 && at == left + own)) {
+        rowTreeSplit(t->right, at - left - own, &t->right, r);
+        rowTreeUpdate(t);
+        *l = t;
+    } else if (at <= left) {
+        rowTreeSplit(t->left, at, l, &t->left);
+        rowTreeUpdate(t);
+        *r = t;
+    } else {
+        /* The split falls inside a span, cut it in two, both to be lexed
+         * again */
+        rownode *u = rowNodeSpan(t->first + at - left, left + own - at);
+        if (t == E.loader) E.loader = u;
+        t->span = at - left;
+        t->hlout = -1;
+        *r = rowTreeMerge(u, t->right);
+        t->right = NULL;
+        rowTreeUpdate(t);
+        *l = t;
+    }
+}
+
+/* Join two trees, all the rows of l coming before those of r. */
+rownode *rowTreeMerge(rownode *l, rownode *r) {
+    if (l == NULL) return r;
+    if (r == NULL) return l;
+    if (l->prio > r->prio) {
+        l->right = rowTreeMerge(l->right, r);
+        rowTreeUpdate(l);
+        return l;
+    } else {
+        r->left = rowTreeMerge(l, r->left);
+        rowTreeUpdate(r);
+        return r;
+    }
+}
+
+/* Fill in the counts and parents of a tree built by rowTreeBuild(). */
+void rowTreeFix(rownode *t) {
+    if (t == NULL) return;
+    rowTreeFix(t->left);
+    rowTreeFix(t->right);
+    rowTreeUpdate(t);
+}
+
+/* Build a tree of the n nodes in order, in O(n) rather than the O(n log n)
+ * of n single inserts, by keeping the right spine on a stack. */
+rownode *rowTreeBuild(rownode **nodes, int n) {
+    rownode **stack = E.alloc->alloc(sizeof(rownode *) * (n + 1));
+    int top = 0;
+    int j;
+
+    for (j = 0; j < n; j++) {
+        rownode *last = NULL;
+        while (top > 0 && stack[top - 1]->prio < nodes[j]->prio)
+            last = stack[--top];
+        nodes[j]->left = last;
+        nodes[j]->right = NULL;
+        if (top > 0) stack[top - 1]->right = nodes[j];
+        stack[top++] = nodes[j];
+    }
+
+    rownode *root = top > 0 ? stack[0] : NULL;
+    E.alloc->free(stack);
+    rowTreeFix(root);
+    return root;
+}
+
+void rowTreeSetRoot(rownode *t) {
+    E.rows = t;
+    if (t) t->parent = NULL;
+    E.numrows = rowTreeCount(t);
+}
+
+/* Take t out of the tree, leaving its subtrees in its place. */
+void rowTreeRemove(rownode *t) {
+    rownode *p = t->parent;
+    rownode *m = rowTreeMerge(t->left, t->right);
+
+    if (p == NULL) {
+        rowTreeSetRoot(m);
+        return;
+    }
+    if (p->left == t) p->left = m;
+    else p->right = m;
+    for (; p; p = p->parent) rowTreeUpdate(p);
+    E.numrows = rowTreeCount(E.rows);
+}
+
+/* The node holding row at, and in *offset where the row is in it. */
+rownode *rowTreeFind(int at, int *offset) {
+    rownode *t = E.rows;
+
+    while (1) {
+        int left = rowTreeCount(t->left);
+        if (at < left) {
+            t = t->left;
+        } else if (at >= left + rowTreeOwn(t)) {
+            at -= left + rowTreeOwn(t);
+            t = t->right;
+        } else {
+            *offset = at - left;
+            return t;
+        }
+    }
+}
+
+/* The number of rows before t. */
+int rowTreeRank(rownode *t) {
+    int rank = rowTreeCount(t->left);
+    for (; t->parent; t = t->parent)
+        if (t->parent->right == t)
+            rank += rowTreeCount(t->parent->left) + rowTreeOwn(t->parent);
+    return rank;
+}
+
+rownode *rowTreeNextNode(rownode *t) {
+    if (t->right) {
+        t = t->right;
+        while (t->left) t = t->left;
+        return t;
+    }
+    while (t->parent && t->parent->right == t) t = t->parent;
+    return t->parent;
+}
+
+rownode *rowTreePrevNode(rownode *t) {
+    if (t->left) {
+        t = t->left;
+        while (t->right) t = t->right;
+        return t;
+    }
+    while (t->parent && t->parent->left == t) t = t->parent;
+    return t->parent;
+}
+
+rownode *rowTreeFirstNode() {
+    rownode *t = E.rows;
+    while (t && t->left) t = t->left;
+    return t;
+}
+
+/* Bring t and the nodes above it up to date after t changed. */
+void rowTreeFixUp(rownode *t) {
+    for (; t; t = t->parent) rowTreeUpdate(t);
+}
+
+/* The first node that has to be lexed again, or NULL, in O(log n). */
+rownode *rowTreeFirstDirty() {
+    rownode *t = E.rows;
+    if (t == NULL || !t->hldirty) return NULL;
+
+    while (1) {
+        if (t->left && t->left->hldirty) t = t->left;
+        else if (t->span != 0 && t->hlout < 0) return t;
+        else t = t->right;
+    }
+}
+
+erow *editorLoadRow(rownode *t, int offset);
+
+erow *editorRowAt(int at) {
+    if (at < 0 || at >= E.numrows) return NULL;
+
+    int offset;
+    rownode *t = rowTreeFind(at, &offset);
+    return t->span < 0 ? &t->row : editorLoadRow(t, offset);
+}
+
+/* The row after row, or NULL for the last one. Walking every row this way
+ * takes O(1) steps per row on average. */
+erow *editorRowNext(erow *row) {
+    rownode *t = rowTreeNextNode((rownode *)row);
+
+    while (t && t->span == 0) t = rowTreeNextNode(t);
+    if (t == NULL) return NULL;
+    return t->span < 0 ? &t->row : editorLoadRow(t, 0);
+}
+
+/*** file map ***/
+
+/* Length of the file line starting at s, without its line ending, and in
+ * *next, where the line after it starts. */
+int editorFileLineLen(char *s, char **next) {
+    char *end = E.map + E.mapsize;
+    char *nl = memchr(s, '\n', end - s);
+    int len = (nl ? nl : end) - s;
+
+    if (next) *next = nl ? nl + 1 : end;
+    while (len > 0 && s[len - 1] == '\r') len--;
+    return len;
+}
+
+char *editorFileLine(int line, int *len) {
+    char *s = E.map + E.linecheck[line / KILO_LINE_CHECK];
+    int j;
+    for (j = line % KILO_LINE_CHECK; j > 0; j--)
+        editorFileLineLen(s, &s);
+    *len = editorFileLineLen(s, NULL);
+    return s;
+}
+
+/* Runs on its own thread, finding where the lines of the mapped file start.
+ * memchr() does the scanning, which is vectorized in any libc that cares. */
+void *editorIndexFile(void *arg) {
+    (void)arg;
+    size_t pos = 0;
+    int lines = 0;
+
+    while (pos < E.mapsize) {
+        if (lines % KILO_LINE_CHECK == 0)
+            E.linecheck[lines / KILO_LINE_CHECK] = pos;
+        char *nl = memchr(E.map + pos, '\n', E.mapsize - pos);
+        pos = nl ? (size_t)(nl - E.map) + 1 : E.mapsize;
+        lines++;
+
+        if (lines % KILO_INDEX_BATCH == 0) {
+            pthread_mutex_lock(&E.indexlock);
+            E.indexed = lines;
+            pthread_cond_broadcast(&E.indexcond);
+            pthread_mutex_unlock(&E.indexlock);
+            editorWake();
+        }
+    }
+
+    pthread_mutex_lock(&E.indexlock);
+    E.indexed = lines;
+    E.indexdone = 1;
+    pthread_cond_broadcast(&E.indexcond);
+    pthread_mutex_unlock(&E.indexlock);
+    editorWake();
+    return NULL;
+}
+
+/* Add the lines indexed since the last call to the rows. Returns whether
+ * there were any, or the index is complete. */
+int editorIndexPoll() {
+    if (E.loader == NULL) return 0;
+
+    pthread_mutex_lock(&E.indexlock);
+    int indexed = E.indexed;
+    int done = E.indexdone;
+    pthread_mutex_unlock(&E.indexlock);
+
+    int added = indexed - E.loaded;
+    E.loader->span += added;
+    if (added > 0) E.loader->hlout = -1;
+    rowTreeFixUp(E.loader);
+    E.numrows += added;
+    E.loaded = indexed;
+
+    if (done) {
+        pthread_join(E.indexer, NULL);
+        E.loader = NULL;
+    }
+    return added > 0 || done;
+}
+
+/* Wait until at least lines lines are indexed, or all of them. */
+void editorIndexWait(int lines) {
+    if (E.loader == NULL) return;
+
+    pthread_mutex_lock(&E.indexlock);
+    while (!E.indexdone && E.indexed < lines)
+        pthread_cond_wait(&E.indexcond, &E.indexlock);
+    pthread_mutex_unlock(&E.indexlock);
+    editorIndexPoll();
+}
+
+/* Map filename and start indexing its lines. Returns -1 if it can't be
+ * mapped. */
+int editorMapFile(int fd, size_t size) {
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) return -1;
+
+    E.map = map;
+    E.mapfd = dup(fd);
+    E.mapsize = size;
+    E.linecheck = malloc(sizeof(size_t) * (size / KILO_LINE_CHECK + 2));
+    E.hlblock = calloc(size / KILO_LINE_CHECK + 2, 1);
+    E.indexed = E.loaded = 0;
+    E.indexdone = 0;
+    E.loader = rowNodeSpan(0, 0);
+    rowTreeSetRoot(rowTreeMerge(E.rows, E.loader));
+
+    pthread_mutex_init(&E.indexlock, NULL);
+    pthread_cond_init(&E.indexcond, NULL);
+    if (pthread_create(&E.indexer, NULL, editorIndexFile, NULL) != 0)
+        die("pthread_create");
+    return 0;
+}
+
 /*** row operations ***/
 
+int editorCountTabs(char *s, int len) {
+    char *end = s + len;
+    int tabs = 0;
+    while ((s = memchr(s, '\t', end - s)) != NULL) {
+        tabs++;
+        s++;
+    }
+    return tabs;
+}
+
+int editorRowTabs(erow *row) {
+    if (row->tabs < 0) row->tabs = editorCountTabs(row->chars, row->size);
+    return row->tabs;
+}
+
+/* Bring the rx of every KILO_RX_CHECK-th char up to date, up to char cx. */
+void editorRowCheckRx(erow *row, int cx) {
+    int k = cx / KILO_RX_CHECK;
+    if (k < row->rxchecks) return;
+
+    row->rxcheck = E.alloc->realloc(row->rxcheck,
+                              sizeof(int) * (row->size / KILO_RX_CHECK + 1));
+    if (row->rxchecks == 0) row->rxcheck[row->rxchecks++] = 0;
+
+    int j = (row->rxchecks - 1) * KILO_RX_CHECK;
+    int rx = row->rxcheck[row->rxchecks - 1];
+    for (; row->rxchecks <= k; j++) {
+        if (row->chars[j] == '\t')
+            rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
+        rx++;
+        if ((j + 1) % KILO_RX_CHECK == 0) row->rxcheck[row->rxchecks++] = rx;
+    }
+}
+
 int editorRowCxToRx(erow *row, int cx) {
-    int rx = 0;
-    int j;
-    for (j = 0; j < cx; j++) {
+    if (editorRowTabs(row) == 0) return cx;
+
+    editorRowCheckRx(row, cx);
+    int j = cx / KILO_RX_CHECK * KILO_RX_CHECK;
+    int rx = row->rxcheck[cx / KILO_RX_CHECK];
+    for (; j < cx; j++) {
         if (row->chars[j] == '\t')
             rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
         rx++;
@@ -196,9 +1050,20 @@ int editorRowCxToRx(erow *row, int cx) {
 }
 
 int editorRowRxToCx(erow *row, int rx) {
-    int cur_rx = 0;
+    if (editorRowTabs(row) == 0) return rx < row->size ? rx : row->size;
+
+    /* Start from the last char kept with an rx no further than rx */
+    editorRowCheckRx(row, row->size);
+    int lo = 0, hi = row->size / KILO_RX_CHECK;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (row->rxcheck[mid] <= rx) lo = mid;
+        else hi = mid - 1;
+    }
+
+    int cur_rx = row->rxcheck[lo];
     int cx;
-    for (cx = 0; cx < row->size; cx++) {
+    for (cx = lo * KILO_RX_CHECK; cx < row->size; cx++) {
         if (row->chars[cx] == '\t')
         cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
         cur_rx++;
@@ -208,14 +1073,85 @@ int editorRowRxToCx(erow *row, int rx) {
     return cx;
 }
 
-void editorUpdateRow(erow *row) {
-    int tabs = 0;
+void editorRenderUnlink(erow *row) {
+    if (row->lruprev) row->lruprev->lrunext = row->lrunext;
+    else E.lruhead = row->lrunext;
+    if (row->lrunext) row->lrunext->lruprev = row->lruprev;
+    else E.lrutail = row->lruprev;
+}
+
+void editorRenderPush(erow *row) {
+    row->lruprev = NULL;
+    row->lrunext = E.lruhead;
+    if (E.lruhead) E.lruhead->lruprev = row;
+    else E.lrutail = row;
+    E.lruhead = row;
+}
+
+/* Move row to the front of the cache, as used last. */
+void editorRenderTouch(erow *row) {
+    if (row != E.lruhead) {
+        editorRenderUnlink(row);
+        editorRenderPush(row);
+    }
+}
+
+/* Bytes held by the render and highlight of row. */
+size_t editorRenderBytes(erow *row) {
+    return (row->render ? row->rsize + 1 : 0) + (row->hl ? row->rsize + 1 : 0);
+}
+
+void editorFreeRender(erow *row) {
+    if (row->render || row->hl) {
+        editorRenderUnlink(row);
+        E.renderbytes -= editorRenderBytes(row);
+        E.alloc->free(row->render);
+        E.alloc->free(row->hl);
+    }
+    row->render = NULL;
+    row->hl = NULL;
+    row->rsize = -1;
+}
+
+/* Free the renders used longest ago, other than that of row, while there
+ * are more than KILO_RENDER_CACHE bytes of them. */
+void editorRenderTrim(erow *row) {
+    while (E.renderbytes > KILO_RENDER_CACHE && E.lrutail != row)
+        editorFreeRender(E.lrutail);
+}
+
+/* The row was edited from char at on. Its render is made again when next
+ * needed, as is the rx of the chars after at, and it is lexed again. */
+void editorUpdateRow(erow *row, int at) {
+    editorFreeRender(row);
+    if (row->rxchecks > at / KILO_RX_CHECK + 1)
+        row->rxchecks = at / KILO_RX_CHECK + 1;
+
+    rownode *t = (rownode *)row;
+    if (t->hlout >= 0) {
+        t->hlout = -1;
+        rowTreeFixUp(t);
+    }
+}
+
+/* The render of row, made now if it is out of date. Renders and highlights
+ * of their own are kept for the rows used last, up to KILO_RENDER_CACHE
+ * bytes of them. */
+char *editorRowRender(erow *row) {
+    if (row->rsize >= 0) {
+        if (row->render || row->hl) editorRenderTouch(row);
+        return row->render ? row->render : row->chars;
+    }
+
+    int tabs = editorRowTabs(row);
     int j;
-    for (j = 0; j < row->size; j++)
-        if (row->chars[j] == '\t') tabs++;
 
-    free(row->render);
-    row->render = malloc(row->size + tabs*(KILO_TAB_STOP - 1) + 1);
+    if (tabs == 0) {
+        row->rsize = row->size;
+        return row->chars;
+    }
+
+    row->render = E.alloc->allocText(row->size + tabs*(KILO_TAB_STOP - 1) + 1);
 
     int idx = 0;
     for (j = 0; j < row->size; j++) {
@@ -228,217 +1164,1547 @@ void editorUpdateRow(erow *row) {
     }
     row->render[idx] = '\0';
     row->rsize = idx;
+
+    editorRenderPush(row);
+    E.renderbytes += row->rsize + 1;
+    editorRenderTrim(row);
+    return row->render;
 }
 
-void editorInsertRow(int at, char *s, size_t len) {
-    if (at < 0 || at > E.numrows) return;
+void editorFillRow(rownode *t, char *s, size_t len) {
+    erow *row = &t->row;
+    row->size = len;
+    E.rowbytes += sizeof(rownode) + len + 1;
+    row->chars = E.alloc->allocText(len + 1);
+    memcpy(row->chars, s, len);
+    row->chars[len] = '\0';
+
+    row->rsize = -1;
+    row->render = NULL;
+    row->hl = NULL;
+    row->hlstate = -1;
+    row->tabs = -1;
+    row->rxcheck = NULL;
+    row->rxchecks = 0;
+    t->span = -1;
+}
+
+rownode *editorNewRow(char *s, size_t len) {
+    rownode *t = E.alloc->alloc(sizeof(rownode));
+    editorFillRow(t, s, len);
+    t->left = t->right = t->parent = NULL;
+    t->prio = rand();
+    t->hlin = t->hlout = -1;
+    rowTreeUpdate(t);
+    return t;
+}
 
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+/* Load line offset of the span t into a row. The span is cut around the
+ * line, which gets a node of its own. */
+erow *editorLoadRow(rownode *t, int offset) {
+    int at = rowTreeRank(t) + offset;
+    rownode *l, *r;
+
+    rowTreeSplit(E.rows, at, &l, &r);
+    rowTreeSplit(r, 1, &t, &r);
+    if (t == E.loader) {
+        E.loader = rowNodeSpan(t->first + 1, 0);
+        r = rowTreeMerge(E.loader, r);
+    }
+
+    int len;
+    char *s = editorFileLine(t->first, &len);
+    editorFillRow(t, s, len);
+    rowTreeUpdate(t);
+    rowTreeSetRoot(rowTreeMerge(rowTreeMerge(l, t), r));
+    return &t->row;
+}
 
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
+/* The text of row at as it is in the mapped file, without loading it, or
+ * NULL if it is loaded already. */
+char *editorRowPeek(int at, int *len) {
+    int offset;
+    rownode *t = rowTreeFind(at, &offset);
+    return t->span < 0 ? NULL : editorFileLine(t->first + offset, len);
+}
 
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    editorUpdateRow(&E.row[at]);
+void editorInsertRow(int at, char *s, size_t len) {
+    if (at < 0 || at > E.numrows) return;
 
-    E.numrows++;
+    rownode *t = editorNewRow(s, len);
+    rownode *l, *r;
+    rowTreeSplit(E.rows, at, &l, &r);
+    rowTreeSetRoot(rowTreeMerge(rowTreeMerge(l, t), r));
     E.dirty++;
 }
 
 void editorFreeRow(erow *row) {
-    free(row->render);
-    free(row->chars);
+    E.rowbytes -= sizeof(rownode) + row->size + 1;
+    editorFreeRender(row);
+    E.alloc->free(row->chars);
+    E.alloc->free(row->rxcheck);
 }
 
 void editorDelRow(int at) {
-    if (at < 0 || at >= E.numrows) return;
-    editorFreeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-    E.numrows--;
+    erow *row = editorRowAt(at);
+    if (row == NULL) return;
+
+    /* The row after it follows another now, so it is lexed again */
+    rownode *next = rowTreeNextNode((rownode *)row);
+    while (next && next->span == 0) next = rowTreeNextNode(next);
+    rowTreeRemove((rownode *)row);
+    if (next) {
+        next->hlout = -1;
+        rowTreeFixUp(next);
+    }
+    editorFreeRow(row);
+    E.alloc->free(row);
     E.dirty++;
 }
 
 void editorRowInsertChar(erow *row, int at, int c) {
     if (at < 0 || at > row->size) at = row->size;
-    row->chars = realloc(row->chars, row->size + 2);
+    row->chars = E.alloc->realloc(row->chars, row->size + 2);
     memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
     row->size++;
+    E.rowbytes++;
     row->chars[at] = c;
-    editorUpdateRow(row);
+    if (row->tabs >= 0 && c == '\t') row->tabs++;
+    editorUpdateRow(row, at);
+    E.dirty++;
+}
+
+void editorRowInsertString(erow *row, int at, char *s, size_t len) {
+    if (at < 0 || at > row->size) at = row->size;
+    row->chars = E.alloc->realloc(row->chars, row->size + len + 1);
+    memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+    memcpy(&row->chars[at], s, len);
+    row->size += len;
+    E.rowbytes += len;
+    if (row->tabs >= 0) row->tabs += editorCountTabs(s, len);
+    editorUpdateRow(row, at);
     E.dirty++;
 }
 
 void editorRowAppendString(erow *row, char *s, size_t len) {
-    row->chars = realloc(row->chars, row->size + len + 1);
+    row->chars = E.alloc->realloc(row->chars, row->size + len + 1);
     memcpy(&row->chars[row->size], s, len);
     row->size += len;
+    E.rowbytes += len;
     row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+    if (row->tabs >= 0) row->tabs += editorCountTabs(s, len);
+    editorUpdateRow(row, row->size - len);
+    E.dirty++;
+}
+
+void editorRowDelChar(erow *row, int at) {
+    if (at < 0 || at >= row->size) return;
+    if (row->tabs >= 0 && row->chars[at] == '\t') row->tabs--;
+    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
+    row->size--;
+    E.rowbytes--;
+    editorUpdateRow(row, at);
     E.dirty++;
 }
 
-void editorRowDelChar(erow *row, int at) {
-    if (at < 0 || at >= row->size) return;
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
-    editorUpdateRow(row);
-    E.dirty++;
+void editorRowDelChars(erow *row, int at, int len) {
+    if (at < 0 || len <= 0 || at + len > row->size) return;
+    if (row->tabs >= 0) row->tabs -= editorCountTabs(&row->chars[at], len);
+    memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+    row->size -= len;
+    E.rowbytes -= len;
+    editorUpdateRow(row, at);
+    E.dirty++;
+}
+
+/*** syntax highlighting ***/
+
+/* A row is highlighted from the lexer state at its start, the one at the
+ * end of the row before. Each node keeps the states at its start and end,
+ * so an edit has only the edited row lexed again, and the rows after it for
+ * as long as the state they start from comes out different. The states of
+ * the rows on the screen are brought up to date before each frame, the rest
+ * in idle time. */
+
+int editorIsSeparator(int c) {
+    return isspace((unsigned char)c) || c == '\0' ||
+           strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+
+/* Highlight the first len of the size chars of s into hl, lexed from state.
+ * Returns the state after them, the one at the end if len is size. */
+int editorLexRow(char *s, int len, int size, int state, unsigned char *hl) {
+    char **keywords = E.syntax->keywords;
+
+    char *scs = E.syntax->singleline_comment_start;
+    char *mcs = E.syntax->multiline_comment_start;
+    char *mce = E.syntax->multiline_comment_end;
+
+    int scs_len = strlen(scs);
+    int mcs_len = strlen(mcs);
+    int mce_len = strlen(mce);
+
+    int prev_sep = 1;
+    int in_string = 0;
+
+    memset(hl, HL_NORMAL, len);
+    int i = 0;
+    while (i < len) {
+        char c = s[i];
+        unsigned char prev_hl = (i > 0) ? hl[i - 1] : HL_NORMAL;
+
+        if (state) {
+            hl[i] = HL_MLCOMMENT;
+            if (c == mce[0] && i + mce_len <= size &&
+                !strncmp(&s[i], mce, mce_len)) {
+                memset(&hl[i], HL_MLCOMMENT, mce_len);
+                i += mce_len;
+                state = 0;
+                prev_sep = 1;
+            } else {
+                i++;
+            }
+            continue;
+        }
+
+        if (in_string) {
+            hl[i] = HL_STRING;
+            if (c == '\\' && i + 1 < size) {
+                hl[i + 1] = HL_STRING;
+                i += 2;
+                continue;
+            }
+            if (c == in_string) in_string = 0;
+            i++;
+            prev_sep = 1;
+            continue;
+        }
+
+        if (scs_len && c == scs[0] && i + scs_len <= size &&
+            !strncmp(&s[i], scs, scs_len)) {
+            memset(&hl[i], HL_COMMENT, len - i);
+            break;
+        }
+        if (mcs_len && c == mcs[0] && i + mcs_len <= size &&
+            !strncmp(&s[i], mcs, mcs_len)) {
+            memset(&hl[i], HL_MLCOMMENT, mcs_len);
+            i += mcs_len;
+            state = 1;
+            continue;
+        }
+        if (c == '"' || c == '\'') {
+            in_string = c;
+            hl[i] = HL_STRING;
+            i++;
+            continue;
+        }
+
+        if ((isdigit((unsigned char)c) && (prev_sep || prev_hl == HL_NUMBER)) ||
+            (c == '.' && prev_hl == HL_NUMBER)) {
+            hl[i] = HL_NUMBER;
+            i++;
+            prev_sep = 0;
+            continue;
+        }
+
+        if (prev_sep && (isalpha((unsigned char)c) || c == '_')) {
+            int j;
+            for (j = 0; keywords[j]; j++) {
+                if (keywords[j][0] != c) continue;
+                int klen = strlen(keywords[j]);
+                int kw2 = keywords[j][klen - 1] == '|';
+                if (kw2) klen--;
+
+                if (i + klen <= size && !strncmp(&s[i], keywords[j], klen) &&
+                    (i + klen == size || editorIsSeparator(s[i + klen]))) {
+                    memset(&hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
+                    i += klen;
+                    break;
+                }
+            }
+            if (keywords[j] != NULL) {
+                prev_sep = 0;
+                continue;
+            }
+        }
+
+        prev_sep = editorIsSeparator(c);
+        i++;
+    }
+    return state;
+}
+
+/* The state at the end of the len chars of s, lexed from state, as
+ * editorLexRow() would return it. Only comments and strings matter to it,
+ * so it skips through the rest, and through comments with memmem(). */
+int editorLexState(char *s, int len, int state) {
+    char *scs = E.syntax->singleline_comment_start;
+    char *mcs = E.syntax->multiline_comment_start;
+    char *mce = E.syntax->multiline_comment_end;
+
+    int scs_len = strlen(scs);
+    int mcs_len = strlen(mcs);
+    int mce_len = strlen(mce);
+
+    char *end = s + len;
+    while (s < end) {
+        if (state) {
+            char *close = memmem(s, end - s, mce, mce_len);
+            if (close == NULL) return 1;
+            s = close + mce_len;
+            state = 0;
+        } else if (*s == '"' || *s == '\'') {
+            char quote = *s++;
+            while (s < end && *s != quote) s += *s == '\\' ? 2 : 1;
+            s++;
+        } else if (scs_len && *s == scs[0] && end - s >= scs_len &&
+                   !strncmp(s, scs, scs_len)) {
+            return 0;
+        } else if (mcs_len && *s == mcs[0] && end - s >= mcs_len &&
+                   !strncmp(s, mcs, mcs_len)) {
+            s += mcs_len;
+            state = 1;
+        } else {
+            s++;
+        }
+    }
+    return state;
+}
+
+/* The state at the end of block k of the mapped file, its KILO_LINE_CHECK
+ * lines from line k * KILO_LINE_CHECK on, lexed from state. The block is
+ * lexed from both states the first time, so it is never lexed again, however
+ * the spans around it are cut. */
+int editorLexBlock(int k, int state) {
+    if (E.hlblock[k] == 0) {
+        char *s = E.map + E.linecheck[k];
+        int out0 = 0, out1 = 1;
+        int j;
+        for (j = 0; j < KILO_LINE_CHECK; j++) {
+            char *next;
+            int len = editorFileLineLen(s, &next);
+            if (out0 == out1) {
+                out0 = out1 = editorLexState(s, len, out0);
+            } else {
+                out0 = editorLexState(s, len, out0);
+                out1 = editorLexState(s, len, out1);
+            }
+            E.hlbudget -= next - s;
+            s = next;
+        }
+        /* Bit 2 says the block is lexed */
+        E.hlblock[k] = 4 | out0 | out1 << 1;
+    }
+    return E.hlblock[k] >> state & 1;
+}
+
+/* Carry *state through the lines of the mapped file from *line up to end,
+ * a block at a time where it can. Returns 0 if the budget ran out first,
+ * with how far it got in *line and *state. */
+int editorLexLines(int *line, int end, int *state) {
+    char *s = NULL;
+    while (*line < end) {
+        if (E.hlbudget <= 0) return 0;
+
+        if (*line % KILO_LINE_CHECK == 0 && *line + KILO_LINE_CHECK <= end) {
+            *state = editorLexBlock(*line / KILO_LINE_CHECK, *state);
+            *line += KILO_LINE_CHECK;
+            s = NULL;
+            continue;
+        }
+
+        int len;
+        char *next;
+        if (s == NULL) s = editorFileLine(*line, &len);
+        len = editorFileLineLen(s, &next);
+        *state = editorLexState(s, len, *state);
+        E.hlbudget -= next - s;
+        s = next;
+        (*line)++;
+    }
+    return 1;
+}
+
+/* The state at the end of span t lexed from in, or -1 if the budget ran
+ * out. A span that takes more than one go is gone on with from where the
+ * last one got, as is the span the lines being indexed are added to. */
+int editorLexSpan(rownode *t, int in) {
+    int line = t->first;
+    int state = in;
+    if (E.hlspan.node == t && E.hlspan.first == t->first &&
+        E.hlspan.in == in && E.hlspan.lines <= t->span) {
+        line += E.hlspan.lines;
+        state = E.hlspan.state;
+    }
+
+    int done = editorLexLines(&line, t->first + t->span, &state);
+    E.hlspan.node = t;
+    E.hlspan.first = t->first;
+    E.hlspan.in = in;
+    E.hlspan.lines = line - t->first;
+    E.hlspan.state = state;
+    return done ? state : -1;
+}
+
+/* The state at the end of the node before t, the one t starts from. */
+int editorHlStateBefore(rownode *t) {
+    do t = rowTreePrevNode(t); while (t && t->span == 0);
+    return t ? t->hlout : 0;
+}
+
+/* Lex the nodes that have to be, in order, until the next one is past row
+ * upto or budget bytes are lexed. Returns whether a row on the screen was
+ * highlighted from a state that turned out wrong. */
+int editorHlSettle(int upto, long budget) {
+    int stale = 0;
+    rownode *t;
+
+    E.hlbudget = budget;
+    while (E.hlbudget > 0 && (t = rowTreeFirstDirty()) != NULL) {
+        int at = rowTreeRank(t);
+        if (at > upto) break;
+
+        int in = editorHlStateBefore(t);
+        int out;
+        if (t->span < 0) {
+            out = editorLexState(t->row.chars, t->row.size, in);
+            E.hlbudget -= t->row.size + 1;
+            if (t->row.hl && t->row.hlstate != in &&
+                at >= E.rowoff && at < E.rowoff + E.screenrows)
+                stale = 1;
+        } else {
+            out = editorLexSpan(t, in);
+            if (out < 0) break;
+        }
+        t->hlin = in;
+        t->hlout = out;
+        rowTreeFixUp(t);
+
+        /* The node after goes on being lexed while its start changes */
+        rownode *next = t;
+        do next = rowTreeNextNode(next); while (next && next->span == 0);
+        if (next && next->hlout >= 0 && next->hlin != out) {
+            next->hlout = -1;
+            rowTreeFixUp(next);
+        }
+    }
+    return stale;
+}
+
+/* The highlight of row lexed from state, made now if it is out of date, up
+ * to the right edge of the screen: the chars past it needn't be, however
+ * long the row is. It is kept along with the render, in the same cache. */
+unsigned char *editorRowHighlight(erow *row, int state) {
+    char *render = editorRowRender(row);
+    int len = E.coloff + E.screencols < row->rsize ? E.coloff + E.screencols
+                                                   : row->rsize;
+    if (row->hl && row->hlstate == state && row->hllen >= len) return row->hl;
+
+    if (row->hl == NULL) {
+        if (row->render == NULL) editorRenderPush(row);
+        row->hl = E.alloc->allocText(row->rsize + 1);
+        E.renderbytes += row->rsize + 1;
+    }
+    int out = editorLexRow(render, len, row->rsize, state, row->hl);
+    rownode *t = (rownode *)row;
+    if (len == row->rsize) row->hlopen = out;
+    else if (t->hlout >= 0 && t->hlin == state) row->hlopen = t->hlout;
+    else row->hlopen = editorLexState(row->chars, row->size, state);
+    row->hllen = len;
+    row->hlstate = state;
+    editorRenderTrim(row);
+    return row->hl;
+}
+
+int editorSyntaxToColor(int hl) {
+    switch (hl) {
+        case HL_COMMENT:
+        case HL_MLCOMMENT: return 36;
+        case HL_KEYWORD1: return 33;
+        case HL_KEYWORD2: return 32;
+        case HL_STRING: return 35;
+        case HL_NUMBER: return 31;
+        default: return 39;
+    }
+}
+
+void editorSelectSyntaxHighlight() {
+    E.syntax = NULL;
+    if (E.filename == NULL) return;
+
+    char *ext = strrchr(E.filename, '.');
+    unsigned int j;
+    for (j = 0; j < HLDB_ENTRIES; j++) {
+        struct editorSyntax *s = &HLDB[j];
+        int i;
+        for (i = 0; s->filematch[i]; i++) {
+            int is_ext = (s->filematch[i][0] == '.');
+            if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+                (!is_ext && strstr(E.filename, s->filematch[i]))) {
+                E.syntax = s;
+                return;
+            }
+        }
+    }
+}
+
+/*** editor operations ***/
+
+void editorInsertChar(int c) {
+    char ch = c;
+    editorUndoRecord(UNDO_INSERT, E.cy, E.cx, &ch, 1, E.cy == E.numrows);
+    if (E.cy == E.numrows) {
+        editorInsertRow(E.numrows, "", 0);
+    }
+    editorRowInsertChar(editorRowAt(E.cy), E.cx, c);
+    E.cx++;
+}
+
+void editorInsertNewline() {
+    /* Past the last row, only the new row is added */
+    if (E.cy == E.numrows) editorUndoRecord(UNDO_INSERT, E.cy, 0, "", 0, 1);
+    else editorUndoRecord(UNDO_INSERT, E.cy, E.cx, "\n", 1, 0);
+
+    if (E.cx == 0) {
+        editorInsertRow(E.cy, "", 0);
+    } else {
+        erow *row = editorRowAt(E.cy);
+        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+        if (row->tabs >= 0)
+            row->tabs -= editorCountTabs(&row->chars[E.cx], row->size - E.cx);
+        E.rowbytes -= row->size - E.cx;
+        row->size = E.cx;
+        row->chars[row->size] = '\0';
+        editorUpdateRow(row, row->size);
+    }
+    E.cy++;
+    E.cx = 0;
+}
+
+/* Insert text at the cursor as if it were typed, but in one go: the row is
+ * split once at each '\n', and the lines after the first go in as one
+ * tree, built in O(n). */
+void editorInsertText(char *s, size_t len) {
+    char *end = s + len;
+    char *brk = memchr(s, '\n', len);
+    if (brk == NULL) brk = end;
+
+    editorUndoRecord(UNDO_INSERT, E.cy, E.cx, s, len, E.cy == E.numrows);
+    if (E.cy == E.numrows) {
+        editorInsertRow(E.numrows, "", 0);
+    }
+    erow *row = editorRowAt(E.cy);
+    if (brk == end) {
+        editorRowInsertString(row, E.cx, s, len);
+        E.cx += len;
+        return;
+    }
+
+    /* What follows the cursor goes after the last line */
+    int taillen = row->size - E.cx;
+    char *tail = E.alloc->allocText(taillen + 1);
+    memcpy(tail, &row->chars[E.cx], taillen);
+    if (row->tabs >= 0) row->tabs -= editorCountTabs(tail, taillen);
+    E.rowbytes -= taillen;
+    row->size = E.cx;
+    row->chars[row->size] = '\0';
+    editorRowAppendString(row, s, brk - s);
+
+    rownode **nodes = NULL;
+    int numnodes = 0, nodecap = 0;
+    while (brk < end) {
+        s = brk + 1;
+        brk = memchr(s, '\n', end - s);
+        if (brk == NULL) brk = end;
+        if (numnodes == nodecap) {
+            nodecap = nodecap ? nodecap * 2 : 64;
+            nodes = E.alloc->realloc(nodes, sizeof(rownode *) * nodecap);
+        }
+        nodes[numnodes++] = editorNewRow(s, brk - s);
+    }
+    E.cx = brk - s;
+    editorRowAppendString(&nodes[numnodes - 1]->row, tail, taillen);
+    E.alloc->free(tail);
+
+    rownode *l, *r;
+    rowTreeSplit(E.rows, E.cy + 1, &l, &r);
+    l = rowTreeMerge(l, rowTreeBuild(nodes, numnodes));
+    rowTreeSetRoot(rowTreeMerge(l, r));
+    E.alloc->free(nodes);
+    E.cy += numnodes;
+    E.dirty++;
+}
+
+void editorDelChar() {
+    if (E.cy == E.numrows) return;
+    if (E.cx == 0 && E.cy == 0) return;
+
+    erow *row = editorRowAt(E.cy);
+    if (E.cx > 0) {
+        editorUndoRecord(UNDO_DELETE, E.cy, E.cx - 1, &row->chars[E.cx - 1], 1,
+                         0);
+        editorRowDelChar(row, E.cx - 1);
+        E.cx--;
+    } else {
+        erow *prev = editorRowAt(E.cy - 1);
+        editorUndoRecord(UNDO_DELETE, E.cy - 1, prev->size, "\n", 1, 0);
+        E.cx = prev->size;
+        editorRowAppendString(prev, row->chars, row->size);
+        editorDelRow(E.cy);
+        E.cy--;
+    }
+}
+
+/* Delete len chars from char x of row y on, the line break at the end of a
+ * row counting as one char. The rows the deletion runs into are joined. */
+void editorDeleteText(int y, int x, int len) {
+    erow *row = editorRowAt(y);
+    if (x + len <= row->size) {
+        editorRowDelChars(row, x, len);
+        return;
+    }
+
+    erow *last = row;
+    int lasty = y, lastx = x;
+    while (len > last->size - lastx) {
+        len -= last->size - lastx + 1;
+        last = editorRowNext(last);
+        lasty++;
+        lastx = 0;
+    }
+    lastx += len;
+
+    E.rowbytes -= row->size - x;
+    row->size = x;
+    row->chars[x] = '\0';
+    row->tabs = -1;
+    editorRowAppendString(row, &last->chars[lastx], last->size - lastx);
+    while (lasty-- > y) editorDelRow(y + 1);
+}
+
+/*** undo ***/
+
+/* The text of op. */
+char *editorUndoText(struct undoOp *op) {
+    return &E.undotext[op->text - E.undobase];
+}
+
+/* Make room in the arena for len more bytes, moving what is left of it to
+ * the front first. */
+void editorUndoReserve(size_t len) {
+    size_t start = E.undofirst < E.undoend ?
+                   E.undo[E.undofirst].text - E.undobase : E.undolen;
+    if (start > 0) {
+        memmove(E.undotext, &E.undotext[start], E.undolen - start);
+        E.undolen -= start;
+        E.undobase += start;
+    }
+    if (E.undolen + len > E.undotextcap) {
+        while (E.undolen + len > E.undotextcap)
+            E.undotextcap = E.undotextcap ? E.undotextcap * 2 : 4096;
+        E.undotext = realloc(E.undotext, E.undotextcap);
+    }
+}
+
+/* Bytes held by the history. */
+size_t editorUndoBytes() {
+    size_t start = E.undofirst < E.undoend ?
+                   E.undo[E.undofirst].text - E.undobase : E.undolen;
+    return E.undolen - start +
+           sizeof(struct undoOp) * (E.undoend - E.undofirst);
+}
+
+/* Drop the oldest edits once there are too many bytes of them, but never
+ * the last one, so that an edit over undomax on its own can still be
+ * undone right after. */
+void editorUndoTrim() {
+    while (E.undofirst + 1 < E.undonext && editorUndoBytes() > E.undomax)
+        E.undofirst++;
+}
+
+/* Whether op was made from typing that the one-char edit at char x of row
+ * y carries on, and if so, add the char to it. */
+int editorUndoMerge(struct undoOp *op, int type, int y, int x, char c) {
+    if (op->type != type || op->y != y || c == '\n' || op->breaks)
+        return 0;
+
+    if (type == UNDO_INSERT && x == op->x + op->len) {
+        E.undotext[E.undolen++] = c;
+    } else if (type == UNDO_DELETE && x == op->x) {
+        E.undotext[E.undolen++] = c;
+    } else if (type == UNDO_DELETE && x + 1 == op->x) {
+        /* Deleting back, the new char comes first */
+        char *text = editorUndoText(op);
+        memmove(text + 1, text, op->len);
+        text[0] = c;
+        E.undolen++;
+        op->x = x;
+    } else {
+        return 0;
+    }
+    op->len++;
+    return 1;
+}
+
+/* Keep the edit about to be made, so that it can be undone. */
+void editorUndoRecord(int type, int y, int x, char *s, int len, int newrow) {
+    if (E.undoing) return;
+
+    /* What was undone can't be redone once something else is edited */
+    if (E.undoend > E.undonext) {
+        E.undolen = E.undo[E.undonext].text - E.undobase;
+        E.undoend = E.undonext;
+    }
+
+    editorUndoReserve(len);
+    if (!E.undoseal && len == 1 && E.undonext > E.undofirst &&
+        editorUndoMerge(&E.undo[E.undonext - 1], type, y, x, s[0])) {
+        editorUndoTrim();
+        return;
+    }
+
+    if (E.undoend == E.undocap) {
+        if (E.undofirst > 0) {
+            memmove(E.undo, &E.undo[E.undofirst],
+                    sizeof(struct undoOp) * (E.undoend - E.undofirst));
+            E.undoend -= E.undofirst;
+            E.undonext -= E.undofirst;
+            E.undofirst = 0;
+        } else {
+            E.undocap = E.undocap ? E.undocap * 2 : 256;
+            E.undo = realloc(E.undo, sizeof(struct undoOp) * E.undocap);
+        }
+    }
+
+    struct undoOp *op = &E.undo[E.undoend++];
+    op->type = type;
+    op->y = y;
+    op->x = x;
+    op->text = E.undobase + E.undolen;
+    op->len = len;
+    op->newrow = newrow;
+    op->breaks = memchr(s, '\n', len) != NULL;
+    op->cy = E.cy;
+    op->cx = E.cx;
+    memcpy(&E.undotext[E.undolen], s, len);
+    E.undolen += len;
+    E.undonext = E.undoend;
+    E.undoseal = 0;
+    editorUndoTrim();
+}
+
+/* Start a new record with the next edit, rather than add to the last one. */
+void editorUndoSeal() {
+    E.undoseal = 1;
+}
+
+/* Make the edit of op, the undone edit if undo is set. */
+void editorUndoApply(struct undoOp *op, int undo) {
+    E.undoing = 1;
+    if ((op->type == UNDO_INSERT) != undo) {
+        if (op->newrow) editorInsertRow(E.numrows, "", 0);
+        E.cy = op->y;
+        E.cx = op->x;
+        if (op->len > 0) editorInsertText(editorUndoText(op), op->len);
+    } else {
+        if (op->len > 0) editorDeleteText(op->y, op->x, op->len);
+        if (op->newrow) editorDelRow(op->y);
+        E.cy = op->y;
+        E.cx = op->x;
+    }
+    E.undoing = 0;
+}
+
+void editorUndo() {
+    if (E.undonext == E.undofirst) {
+        editorSetStatusMessage("Nothing to undo");
+        return;
+    }
+    struct undoOp *op = &E.undo[--E.undonext];
+    editorUndoApply(op, 1);
+    E.cy = op->cy;
+    E.cx = op->cx;
+    editorUndoSeal();
+}
+
+void editorRedo() {
+    if (E.undonext == E.undoend) {
+        editorSetStatusMessage("Nothing to redo");
+        return;
+    }
+    editorUndoApply(&E.undo[E.undonext++], 0);
+    editorUndoSeal();
+}
+
+/*** snapshots ***/
+
+/* Take a snapshot of the rows. Lines of the mapped file are only pointed
+ * to, so it costs no more than copying the loaded rows. */
+void editorSnapshot(struct snapshot *snap) {
+    size_t bytes = 0;
+    int nodes = 0;
+    rownode *t;
+    for (t = rowTreeFirstNode(); t; t = rowTreeNextNode(t)) {
+        if (t->span < 0) bytes += t->row.size + 1;
+        nodes++;
+    }
+
+    snap->text = malloc(bytes + 1);
+    snap->pieces = malloc(sizeof(struct snapshotPiece) * (nodes + 1));
+    snap->numpieces = 0;
+    snap->rows = E.numrows;
+    snap->tail = -1;
+
+    char *text = snap->text;
+    struct snapshotPiece *p = NULL;
+    int at = 0;
+    for (t = rowTreeFirstNode(); t; t = rowTreeNextNode(t)) {
+        if (t->span < 0) {
+            /* Rows loaded one after another share a piece */
+            if (p == NULL || p->first >= 0) {
+                p = &snap->pieces[snap->numpieces++];
+                p->s = text;
+                p->at = at;
+                p->rows = 0;
+                p->first = -1;
+            }
+            memcpy(text, t->row.chars, t->row.size);
+            text += t->row.size;
+            *text++ = '\n';
+            p->end = text;
+            p->rows++;
+        } else if (t->span > 0) {
+            int len;
+            p = &snap->pieces[snap->numpieces++];
+            p->s = editorFileLine(t->first, &len);
+            p->end = editorFileLine(t->first + t->span - 1, &len) + len;
+            p->at = at;
+            p->rows = t->span;
+            p->first = t->first;
+        }
+        if (t == E.loader) {
+            /* Where the lines still to be indexed will be, for
+             * editorSnapshotRest() */
+            snap->tail = snap->numpieces;
+            snap->loaded = E.loaded;
+            p = NULL;
+        }
+        at += rowTreeOwn(t);
+    }
+}
+
+/* Wait for the mapped file to be indexed to the end, then add the lines
+ * that weren't yet to snap, where they go. It is for the save thread, which
+ * can wait. Returns the bytes added. */
+size_t editorSnapshotRest(struct snapshot *snap) {
+    if (snap->tail < 0) return 0;
+
+    pthread_mutex_lock(&E.indexlock);
+    while (!E.indexdone)
+        pthread_cond_wait(&E.indexcond, &E.indexlock);
+    int indexed = E.indexed;
+    pthread_mutex_unlock(&E.indexlock);
+    if (indexed == snap->loaded) return 0;
+
+    /* There is room for it, the pieces having one more than the nodes */
+    struct snapshotPiece *p = &snap->pieces[snap->tail];
+    int at = snap->tail < snap->numpieces ? p->at : snap->rows;
+    memmove(p + 1, p, sizeof(*p) * (snap->numpieces - snap->tail));
+    snap->numpieces++;
+
+    int len, k;
+    p->s = editorFileLine(snap->loaded, &len);
+    p->end = editorFileLine(indexed - 1, &len) + len;
+    p->at = at;
+    p->rows = indexed - snap->loaded;
+    p->first = snap->loaded;
+    for (k = snap->tail + 1; k < snap->numpieces; k++)
+        snap->pieces[k].at += p->rows;
+    snap->rows += p->rows;
+    return p->end - p->s + 1;
+}
+
+/* Length of the line of piece p starting at s, and in *next, where the line
+ * after it starts. */
+int editorPieceLineLen(struct snapshotPiece *p, char *s, char **next) {
+    char *nl = memchr(s, '\n', p->end - s);
+    int len = (nl ? nl : p->end) - s;
+
+    if (next) *next = nl ? nl + 1 : p->end;
+    while (len > 0 && s[len - 1] == '\r') len--;
+    return len;
+}
+
+void editorFreeSnapshot(struct snapshot *snap) {
+    free(snap->text);
+    free(snap->pieces);
+}
+
+/*** file i/o ***/
+
+/* Write out all of the n buffers of iov, going on after short writes. */
+int editorWriteAll(int fd, struct iovec *iov, int n) {
+    while (n > 0) {
+        ssize_t w = writev(fd, iov, n);
+        if (w == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (n > 0 && (size_t)w >= iov->iov_len) {
+            w -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return 0;
+}
+
+void editorSaveProgress(size_t bytes) {
+    pthread_mutex_lock(&E.savelock);
+    E.savebytes += bytes;
+    pthread_mutex_unlock(&E.savelock);
+    editorWake();
+}
+
+int editorSaveFlush(int fd, struct iovec *iov, int *n) {
+    size_t bytes = 0;
+    int j;
+    for (j = 0; j < *n; j++) bytes += iov[j].iov_len;
+    if (editorWriteAll(fd, iov, *n) == -1) return -1;
+    *n = 0;
+    editorSaveProgress(bytes);
+    return 0;
+}
+
+int editorSaveQueue(int fd, struct iovec *iov, int *n, const char *s,
+                    size_t len) {
+    if (*n == KILO_SAVE_IOV && editorSaveFlush(fd, iov, n) == -1) return -1;
+    iov[*n].iov_base = (char *)s;
+    iov[*n].iov_len = len;
+    (*n)++;
+    return 0;
+}
+
+/* Copy len bytes of the mapped file from s. The kernel does the copying
+ * where it can, so lines that were never loaded aren't read in to be
+ * saved, and a filesystem that shares blocks between files needn't copy
+ * them at all. */
+int editorSaveMapped(int fd, char *s, size_t len) {
+    loff_t off = s - E.map;
+    while (len > 0) {
+        size_t chunk = len < KILO_SAVE_CHUNK ? len : KILO_SAVE_CHUNK;
+        ssize_t n = copy_file_range(E.mapfd, &off, fd, NULL, chunk, 0);
+        if (n <= 0) break;
+        len -= n;
+        editorSaveProgress(n);
+    }
+
+    while (len > 0) {
+        size_t chunk = len < KILO_SAVE_CHUNK ? len : KILO_SAVE_CHUNK;
+        struct iovec iov;
+        iov.iov_base = E.map + off;
+        iov.iov_len = chunk;
+        int one = 1;
+        if (editorSaveFlush(fd, &iov, &one) == -1) return -1;
+        off += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+/* Write the rows of snap to fd, each ending in a '\n', straight from where
+ * they are rather than joined into one string first. Returns -1 with errno
+ * set if that fails. */
+int editorWriteSnapshot(int fd, struct snapshot *snap) {
+    struct iovec iov[KILO_SAVE_IOV];
+    int n = 0;
+    int k, j;
+
+    for (k = 0; k < snap->numpieces; k++) {
+        struct snapshotPiece *p = &snap->pieces[k];
+        if (p->first < 0) {
+            if (editorSaveQueue(fd, iov, &n, p->s, p->end - p->s) == -1)
+                return -1;
+            continue;
+        }
+
+        if (!memchr(p->s, '\r', p->end - p->s)) {
+            if (editorSaveFlush(fd, iov, &n) == -1 ||
+                editorSaveMapped(fd, p->s, p->end - p->s) == -1 ||
+                editorSaveQueue(fd, iov, &n, "\n", 1) == -1)
+                return -1;
+            continue;
+        }
+
+        /* Lines ending in "\r\n" are saved with a '\n' only, as rows are */
+        char *s = p->s;
+        for (j = 0; j < p->rows; j++) {
+            char *line = s;
+            int len = editorPieceLineLen(p, line, &s);
+            if (editorSaveQueue(fd, iov, &n, line, len) == -1 ||
+                editorSaveQueue(fd, iov, &n, "\n", 1) == -1)
+                return -1;
+        }
+    }
+    return editorSaveFlush(fd, iov, &n);
+}
+
+void editorOpen(char *filename) {
+    free(E.filename);
+    E.filename = strdup(filename);
+    editorSelectSyntaxHighlight();
+
+    FILE *fp = fopen(filename, "r");
+    if (!fp) die("fopen");
+
+    /* Only the first screen is read before the file shows up, the rest is
+     * indexed in the background and loaded as it is needed */
+    struct stat st;
+    if (fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size >= KILO_MMAP_MIN &&
+        editorMapFile(fileno(fp), st.st_size) == 0) {
+        fclose(fp);
+        editorIndexWait(E.screenrows);
+        E.dirty = 0;
+        return;
+    }
+
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    rownode **nodes = NULL;
+    int numnodes = 0, nodecap = 0;
+    while ((linelen = getline(&line, &linecap, fp)) != -1) { 
+        while (linelen > 0 && (line[linelen - 1] == '\n' ||
+                                line[linelen - 1] == '\r'))
+            linelen--;
+        if (numnodes == nodecap) {
+            nodecap = nodecap ? nodecap * 2 : 1024;
+            nodes = E.alloc->realloc(nodes, sizeof(rownode *) * nodecap);
+        }
+        nodes[numnodes++] = editorNewRow(line, linelen);
+    }
+    free(line);
+    fclose(fp);
+
+    rowTreeSetRoot(rowTreeMerge(E.rows, rowTreeBuild(nodes, numnodes)));
+    E.alloc->free(nodes);
+    E.dirty = 0;
+}
+
+/* Write the snapshot to the temporary file, then put that in place of the
+ * file, so that the file is never left half written. Returns 0, or the
+ * errno of what failed. */
+int editorSaveFile() {
+    int fd = E.savefd;
+    size_t rest = editorSnapshotRest(&E.savesnap);
+    pthread_mutex_lock(&E.savelock);
+    E.savetotal += rest;
+    pthread_mutex_unlock(&E.savelock);
+
+    if (editorWriteSnapshot(fd, &E.savesnap) == -1 || fsync(fd) == -1) {
+        int err = errno;
+        close(fd);
+        unlink(E.savepath);
+        return err;
+    }
+    if (close(fd) == -1 || rename(E.savepath, E.savetarget) == -1) {
+        int err = errno;
+        unlink(E.savepath);
+        return err;
+    }
+
+    /* The rename is only sure to last once the directory is on disk too */
+    char *dir = strdup(E.savetarget);
+    int dirfd = open(dirname(dir), O_RDONLY);
+    if (dirfd != -1) {
+        fsync(dirfd);
+        close(dirfd);
+    }
+    free(dir);
+    return 0;
+}
+
+/* Runs on its own thread, for saves of mapped files. */
+void *editorSaveThread(void *arg) {
+    (void)arg;
+    int err = editorSaveFile();
+
+    pthread_mutex_lock(&E.savelock);
+    E.saveerrno = err;
+    E.savedone = 1;
+    pthread_mutex_unlock(&E.savelock);
+    editorWake();
+    return NULL;
+}
+
+void editorSaveFinish() {
+    editorFreeSnapshot(&E.savesnap);
+    free(E.savepath);
+    free(E.savetarget);
+    E.saving = 0;
+
+    if (E.saveerrno == 0) {
+        /* Edits made while saving are still to be saved */
+        E.dirty -= E.savedirty;
+        editorSetStatusMessage("%zu bytes written to disk", E.savebytes);
+    } else {
+        editorSetStatusMessage("Can't save! I/O error: %s",
+                               strerror(E.saveerrno));
+    }
+}
+
+/* Take in how the save in the background is going. Returns whether the
+ * screen is out of date. */
+int editorSavePoll() {
+    static int lastpercent = -1;
+    if (!E.saving) return 0;
+
+    pthread_mutex_lock(&E.savelock);
+    size_t bytes = E.savebytes;
+    size_t total = E.savetotal;
+    int done = E.savedone;
+    pthread_mutex_unlock(&E.savelock);
+
+    if (done) {
+        pthread_join(E.saver, NULL);
+        editorSaveFinish();
+        lastpercent = -1;
+        return 1;
+    }
+
+    int percent = total ? bytes * 100 / total : 0;
+    if (percent == lastpercent) return 0;
+    lastpercent = percent;
+    editorSetStatusMessage("Saving %.20s: %d%%", E.filename, percent);
+    return 1;
+}
+
+/* Wait for the save in the background, if there is one, to be over. */
+void editorSaveWait() {
+    if (!E.saving) return;
+    pthread_join(E.saver, NULL);
+    editorSaveFinish();
+}
+
+void editorSave() {
+    if (E.filename == NULL) {
+        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+        if (E.filename == NULL) {
+            editorSetStatusMessage("Save aborted");
+            return;
+        }
+        editorSelectSyntaxHighlight();
+    }
+    if (E.saving) {
+        editorSetStatusMessage("Still saving, try again once that is done");
+        return;
+    }
+
+    /* A symlink is followed, so that the file it points to is the one
+     * replaced, rather than the link */
+    E.savetarget = realpath(E.filename, NULL);
+    if (E.savetarget == NULL) {
+        if (errno != ENOENT) {
+            editorSetStatusMessage("Can't save! I/O error: %s",
+                                   strerror(errno));
+            return;
+        }
+        E.savetarget = strdup(E.filename);
+    }
+
+    /* The new file takes the permissions of the one it replaces */
+    struct stat st;
+    mode_t mode = stat(E.savetarget, &st) == 0 ? st.st_mode & 07777 : 0644;
+    /* A temporary name of its own next to the file, so that no file is
+     * written over, nor one another kilo is saving to */
+    E.savepath = malloc(strlen(E.savetarget) + 8);
+    sprintf(E.savepath, "%s.XXXXXX", E.savetarget);
+    int fd = mkstemp(E.savepath);
+    if (fd == -1 || fchmod(fd, mode) == -1) {
+        int err = errno;
+        if (fd != -1) {
+            close(fd);
+            unlink(E.savepath);
+        }
+        free(E.savepath);
+        free(E.savetarget);
+        editorSetStatusMessage("Can't save! I/O error: %s", strerror(err));
+        return;
+    }
+
+    editorSnapshot(&E.savesnap);
+    E.savefd = fd;
+    E.savedirty = E.dirty;
+    E.savebytes = 0;
+    E.savetotal = 0;
+    int k;
+    for (k = 0; k < E.savesnap.numpieces; k++)
+        E.savetotal += E.savesnap.pieces[k].end - E.savesnap.pieces[k].s + 1;
+    E.savedone = 0;
+    E.saving = 1;
+
+    /* Lines of a mapped file are saved in the background, as are the ones
+     * still to be indexed, others are few enough to be written right away */
+    if (E.map &&
+        pthread_create(&E.saver, NULL, editorSaveThread, NULL) == 0) {
+        editorSetStatusMessage("Saving %.20s: 0%%", E.filename);
+        return;
+    }
+    E.saveerrno = editorSaveFile();
+    editorSaveFinish();
+}
+
+/*** find ***/
+
+/* Whether the query is in the render of a line, the text of which is s.
+ * Only called on the search thread. */
+int editorLineMatches(char *s, int len) {
+    static char *render = NULL;
+    static int rendercap = 0;
+    int qlen = strlen(E.query);
+
+    /* Tabs render as spaces, so only a query with a space can match where
+     * the text of the line doesn't */
+    if (!E.querytabs || !memchr(s, '\t', len))
+        return memmem(s, len, E.query, qlen) != NULL;
+
+    if (len * KILO_TAB_STOP > rendercap) {
+        rendercap = len * KILO_TAB_STOP;
+        render = realloc(render, rendercap);
+    }
+    int idx = 0;
+    int j;
+    for (j = 0; j < len; j++) {
+        if (s[j] == '\t') {
+            render[idx++] = ' ';
+            while (idx % KILO_TAB_STOP != 0) render[idx++] = ' ';
+        } else {
+            render[idx++] = s[j];
+        }
+    }
+    return memmem(render, idx, E.query, qlen) != NULL;
 }
 
-/*** editor operations ***/
+/* The line of piece p that s is in, and in *start, where that line starts.
+ * Lines of the file are found from the line index, copied rows are counted
+ * from the start of the piece. */
+int editorPieceLineOf(struct snapshotPiece *p, char *s, char **start) {
+    char *line = p->s;
+    int j = 0;
+
+    if (p->first >= 0) {
+        size_t off = s - E.map;
+        int lo = p->first / KILO_LINE_CHECK;
+        int hi = (p->first + p->rows - 1) / KILO_LINE_CHECK;
+        while (lo < hi) {
+            int mid = (lo + hi + 1) / 2;
+            if (E.linecheck[mid] <= off) lo = mid;
+            else hi = mid - 1;
+        }
+        if (lo * KILO_LINE_CHECK > p->first) {
+            line = E.map + E.linecheck[lo];
+            j = lo * KILO_LINE_CHECK - p->first;
+        }
+    }
 
-void editorInsertChar(int c) {
-    if (E.cy == E.numrows) {
-        editorInsertRow(E.numrows, "", 0);
+    char *next;
+    for (;;) {
+        editorPieceLineLen(p, line, &next);
+        if (next > s || next >= p->end) break;
+        line = next;
+        j++;
     }
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
-    E.cx++;
+    *start = line;
+    return j;
 }
 
-void editorInsertNewline() {
-    if (E.cx == 0) {
-        editorInsertRow(E.cy, "", 0);
-    } else {
-        erow *row = &E.row[E.cy];
-        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-        row = &E.row[E.cy];
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        editorUpdateRow(row);
+/* Hand the hits found since the last call to the main thread. Returns
+ * whether the search is to stop, as the query changed. */
+int editorSearchFlush(int *batch, int *n, int rows, int done) {
+    pthread_mutex_lock(&E.searchlock);
+    if (E.numhits + *n > E.hitcap) {
+        while (E.numhits + *n > E.hitcap)
+            E.hitcap = E.hitcap ? E.hitcap * 2 : 64;
+        E.hits = realloc(E.hits, sizeof(int) * E.hitcap);
     }
-    E.cy++;
-    E.cx = 0;
+    if (*n) memcpy(&E.hits[E.numhits], batch, sizeof(int) * *n);
+    E.numhits += *n;
+    E.hitrows = rows;
+    E.searchdone = done;
+    int cancel = E.searchcancel;
+    pthread_cond_broadcast(&E.searchcond);
+    pthread_mutex_unlock(&E.searchlock);
+    editorWake();
+
+    *n = 0;
+    return cancel;
 }
 
-void editorDelChar() {
-    if (E.cy == E.numrows) return;
-    if (E.cx == 0 && E.cy == 0) return;
+#define SEARCH_BATCH 256
+
+/* Runs on its own thread. Checks the hits of the shorter query again, then
+ * searches the rows after those. The text of a piece is searched with
+ * memmem() a chunk at a time rather than line by line, so lines without a
+ * match cost next to nothing, and lines are only counted up to matches. */
+void *editorSearchThread(void *arg) {
+    (void)arg;
+    int batch[SEARCH_BATCH];
+    int n = 0;
+    int qlen = strlen(E.query);
+    int pi = 0;
+    char *s = NULL;
+    int line = 0;
+    int k;
+
+    for (k = 0; k < E.numold; k++) {
+        int h = E.oldhits[k];
+        while (h >= E.searchsnap.pieces[pi].at + E.searchsnap.pieces[pi].rows) {
+            pi++;
+            s = NULL;
+        }
+        struct snapshotPiece *p = &E.searchsnap.pieces[pi];
+        int offset = h - p->at;
 
-    erow *row = &E.row[E.cy];
-    if (E.cx > 0) {
-        editorRowDelChar(row, E.cx - 1);
-        E.cx--;
-    } else {
-        E.cx = E.row[E.cy - 1].size;
-        editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-        editorDelRow(E.cy);
-        E.cy--;
+        if (s == NULL || (p->first >= 0 && offset - line > KILO_LINE_CHECK)) {
+            int len;
+            s = p->first >= 0 ? editorFileLine(p->first + offset, &len) : p->s;
+            line = p->first >= 0 ? offset : 0;
+        }
+        for (; line < offset; line++) editorPieceLineLen(p, s, &s);
+        if (editorLineMatches(s, editorPieceLineLen(p, s, NULL)))
+            batch[n++] = h;
+        if (n == SEARCH_BATCH && editorSearchFlush(batch, &n, h + 1, 0))
+            return NULL;
     }
-}
+    if (editorSearchFlush(batch, &n, E.oldrows, 0)) return NULL;
 
-/*** file i/o ***/
+    for (pi = 0; pi < E.searchsnap.numpieces; pi++) {
+        struct snapshotPiece *p = &E.searchsnap.pieces[pi];
+        if (E.oldrows >= p->at + p->rows) continue;
 
-char *editorRowsToString(int *buflen) {
-    int totlen = 0;
-    int j;
-    for (j = 0; j < E.numrows; j++)
-        totlen += E.row[j].size + 1;
-    *buflen = totlen;
+        /* Where the first row not searched yet starts, and which it is */
+        int j = E.oldrows > p->at ? E.oldrows - p->at : 0;
+        int len;
+        if (p->first >= 0) {
+            s = editorFileLine(p->first + j, &len);
+        } else {
+            s = p->s;
+            for (line = 0; line < j; line++) editorPieceLineLen(p, s, &s);
+        }
+
+        while (s < p->end) {
+            char *chunk = p->end;
+            if (p->end - s > KILO_SEARCH_CHUNK)
+                editorPieceLineLen(p, s + KILO_SEARCH_CHUNK, &chunk);
+
+            while (s < chunk) {
+                /* A line with a tab is checked as rendered. The query has
+                 * no tab, so no match in the text runs past one. */
+                char *tab = E.querytabs ? memchr(s, '\t', chunk - s) : NULL;
+                char *m = memmem(s, (tab ? tab : chunk) - s, E.query, qlen);
+                if (m == NULL) m = tab;
+                if (m == NULL) {
+                    if (chunk == p->end) {
+                        j = p->rows;
+                    } else if (p->first >= 0) {
+                        j = editorPieceLineOf(p, chunk, &s);
+                    } else {
+                        for (; s < chunk; j++) editorPieceLineLen(p, s, &s);
+                    }
+                    s = chunk;
+                    break;
+                }
 
-    char *buf = malloc(totlen);
-    char *p = buf;
-    for (j = 0; j < E.numrows; j++) {
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        p += E.row[j].size;
-        *p = '\n';
-        p++;
+                if (p->first >= 0 && m - s > KILO_SEARCH_CHUNK / 64) {
+                    j = editorPieceLineOf(p, m, &s);
+                } else {
+                    char *nl;
+                    while ((nl = memchr(s, '\n', m - s)) != NULL) {
+                        s = nl + 1;
+                        j++;
+                    }
+                }
+                char *next;
+                len = editorPieceLineLen(p, s, &next);
+                if (editorLineMatches(s, len)) {
+                    batch[n++] = p->at + j;
+                    if (n == SEARCH_BATCH &&
+                        editorSearchFlush(batch, &n, p->at + j + 1, 0))
+                        return NULL;
+                }
+                s = next;
+                j++;
+            }
+            if (editorSearchFlush(batch, &n, p->at + j, 0)) return NULL;
+        }
     }
 
-    return buf;
+    editorSearchFlush(batch, &n, E.searchsnap.rows, 1);
+    return NULL;
 }
 
-void editorOpen(char *filename) {
-    free(E.filename);
-    E.filename = strdup(filename);
+/* Stop the search thread, if there is one, and free what it worked on.
+ * The hits it found so far are kept. */
+void editorSearchCancel() {
+    if (!E.searching) return;
 
-    FILE *fp = fopen(filename, "r");
-    if (!fp) die("fopen");
+    pthread_mutex_lock(&E.searchlock);
+    E.searchcancel = 1;
+    pthread_mutex_unlock(&E.searchlock);
+    pthread_join(E.searcher, NULL);
+    E.searching = 0;
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    while ((linelen = getline(&line, &linecap, fp)) != -1) { 
-        while (linelen > 0 && (line[linelen - 1] == '\n' ||
-                                line[linelen - 1] == '\r'))
-            linelen--;
-        editorInsertRow(E.numrows, line, linelen);
-    }
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
+    editorFreeSnapshot(&E.searchsnap);
+    free(E.oldhits);
+    E.oldhits = NULL;
 }
 
-void editorSave() {
-    if (E.filename == NULL) {
-        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-        if (E.filename == NULL) {
-            editorSetStatusMessage("Save aborted");
-            return;
+/* Start searching for query. When it is what the last search was for, only
+ * the rows indexed since are searched, and when it only got longer, the
+ * hits so far are checked again rather than all the rows searched. */
+void editorSearchStart(char *query) {
+    int same = E.query && strcmp(query, E.query) == 0;
+    if (same && (E.searching || E.hitrows >= E.numrows)) return;
+
+    editorSearchCancel();
+    E.numold = 0;
+    E.oldrows = E.hitrows;
+    if (!same) {
+        if (E.query && E.query[0] &&
+            strncmp(query, E.query, strlen(E.query)) == 0) {
+            E.oldhits = E.hits;
+            E.numold = E.numhits;
+        } else {
+            free(E.hits);
+            E.oldrows = 0;
         }
+        E.hits = NULL;
+        E.numhits = E.hitcap = 0;
+        E.hitrows = 0;
+
+        free(E.query);
+        E.query = strdup(query);
+        E.querytabs = strchr(query, ' ') != NULL;
+    }
+    E.searchdone = 0;
+    E.searchcancel = 0;
+
+    if (query[0] == '\0') {
+        free(E.oldhits);
+        E.oldhits = NULL;
+        E.hitrows = E.numrows;
+        E.searchdone = 1;
+        return;
     }
 
-    int len;
-    char *buf = editorRowsToString(&len);
-
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-    if (fd != -1) {
-        if (ftruncate(fd, len) != -1) {
-            if (write(fd, buf, len) == len) {
-                close(fd);
-                free(buf);
-                E.dirty = 0;
-                editorSetStatusMessage("%d bytes written to disk", len);
-                return;
-            }
-        }
-        close(fd);
+    editorSnapshot(&E.searchsnap);
+    if (pthread_create(&E.searcher, NULL, editorSearchThread, NULL) != 0)
+        die("pthread_create");
+    E.searching = 1;
+
+    /* Most searches are over long before a key could be typed, those are
+     * waited for, so that the cursor is on the match in the next frame */
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += KILO_SEARCH_WAIT * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
     }
+    pthread_mutex_lock(&E.searchlock);
+    while (!E.searchdone && E.numhits == 0)
+        if (pthread_cond_timedwait(&E.searchcond, &E.searchlock,
+                                   &until) != 0) break;
+    pthread_mutex_unlock(&E.searchlock);
+}
 
-    free(buf);
-    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+void editorSearchStop() {
+    editorSearchCancel();
+    free(E.query);
+    free(E.hits);
+    E.query = NULL;
+    E.hits = NULL;
+    E.numhits = E.hitcap = 0;
+    E.hit = -1;
 }
 
-/*** find ***/
+/* Move the cursor to the match E.hit. */
+void editorSearchGoto() {
+    pthread_mutex_lock(&E.searchlock);
+    int at = E.hits[E.hit];
+    pthread_mutex_unlock(&E.searchlock);
+
+    erow *row = editorRowAt(at);
+    char *render = editorRowRender(row);
+    char *match = strstr(render, E.query);
+    if (match) {
+        E.cy = at;
+        E.cx = editorRowRxToCx(row, match - render);
+        E.rowoff = E.numrows;
+    }
+}
 
-void editorFindCallback(char *query, int key) {
-    static int last_match = -1;
-    static int direction = 1;
+/* Take in what the search thread found since the last call, going to the
+ * first match once there is one. Returns whether the screen is out of
+ * date. */
+int editorSearchPoll() {
+    if (E.query == NULL) return 0;
+
+    pthread_mutex_lock(&E.searchlock);
+    int numhits = E.numhits;
+    int hitrows = E.hitrows;
+    int done = E.searchdone;
+    pthread_mutex_unlock(&E.searchlock);
+
+    int changed = numhits != E.seenhits || hitrows != E.seenrows;
+    E.seenhits = numhits;
+    E.seenrows = hitrows;
+    if (E.hit == -1 && numhits > 0) {
+        E.hit = 0;
+        editorSearchGoto();
+        changed = 1;
+    }
+    if (done && E.searching) editorSearchCancel();
+    return changed;
+}
 
+void editorFindCallback(char *query, int key) {
     if (key == '\r' || key == '\x1b') {
-        last_match = -1;
-        direction = 1;
+        editorSearchStop();
         return;
-    } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-        direction = 1;
-    } else if (key == ARROW_LEFT || key == ARROW_UP) {
-        direction = -1;
-    } else {
-        last_match = -1;
-        direction = 1;
-    }
-
-    if (last_match == -1) direction = 1;
-    int current = last_match;
-    int i;
-    for (i = 0; i < E.numrows; i++) {
-        current += direction;
-        if (current == -1) current = E.numrows - 1;
-        else if (current == E.numrows) current = 0;
-
-        erow *row = &E.row[current];
-        char *match = strstr(row->render, query);
-        if (match) {
-            last_match = current;
-            E.cy = current;
-            E.cx = editorRowRxToCx(row, match - row->render);
-            E.rowoff = E.numrows;
-            break;
-        }
     }
+
+    int next = key == ARROW_RIGHT || key == ARROW_DOWN;
+    int prev = key == ARROW_LEFT || key == ARROW_UP;
+    if (!next && !prev) E.hit = -1;
+
+    /* Rows indexed since the last key are searched too */
+    editorSearchStart(query);
+    if (E.hit == -1) {
+        editorSearchPoll();
+        return;
+    }
+
+    pthread_mutex_lock(&E.searchlock);
+    int numhits = E.numhits;
+    int done = E.searchdone;
+    pthread_mutex_unlock(&E.searchlock);
+
+    /* Until the search is over, the last match found so far isn't the
+     * last one, so there is no wrapping around yet */
+    if (next) {
+        if (E.hit + 1 < numhits) E.hit++;
+        else if (done) E.hit = 0;
+    } else if (prev) {
+        if (E.hit > 0) E.hit--;
+        else if (done) E.hit = numhits - 1;
+    }
+    editorSearchGoto();
 }
 
 void editorFind() {
@@ -465,21 +2731,66 @@ void editorFind() {
 struct abuf {
     char *b;
     int len;
+    int cap;
 };
 
-#define ABUF_INIT {NULL, 0}
-
-void abAppend(struct abuf *ab, const char *s, int len) {
-    char *new = realloc(ab->b, ab->len + len);
+#define ABUF_INIT {NULL, 0, 0}
 
-    if (new == NULL) return;
-    memcpy(&new[ab->len], s, len);
+/* Make room for len more bytes, doubling the capacity so that a run of
+ * appends costs amortized constant time. */
+int abGrow(struct abuf *ab, int len) {
+    if (ab->len + len <= ab->cap) return 0;
+    int cap = ab->cap ? ab->cap : 64;
+    while (cap < ab->len + len) cap *= 2;
+    char *new = realloc(ab->b, cap);
+    if (new == NULL) return -1;
     ab->b = new;
+    ab->cap = cap;
+    return 0;
+}
+
+void abAppend(struct abuf *ab, const char *s, int len) {
+    if (abGrow(ab, len) == -1) return;
+    memcpy(&ab->b[ab->len], s, len);
     ab->len += len;
 }
 
+void abAppendRepeat(struct abuf *ab, char c, int n) {
+    if (n <= 0 || abGrow(ab, n) == -1) return;
+    memset(&ab->b[ab->len], c, n);
+    ab->len += n;
+}
+
+void abAppendNum(struct abuf *ab, int n) {
+    char digits[12];
+    int i = sizeof(digits);
+    unsigned int u = n < 0 ? -(unsigned int)n : (unsigned int)n;
+    do {
+        digits[--i] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (n < 0) digits[--i] = '-';
+    abAppend(ab, &digits[i], sizeof(digits) - i);
+}
+
+/* Move the cursor to row y, column x, both counted from 1 */
+void abAppendCursor(struct abuf *ab, int y, int x) {
+    abAppend(ab, "\x1b[", 2);
+    abAppendNum(ab, y);
+    abAppend(ab, ";", 1);
+    abAppendNum(ab, x);
+    abAppend(ab, "H", 1);
+}
+
+/* Empty the buffer but keep its memory for the next use */
+void abReset(struct abuf *ab) {
+    ab->len = 0;
+}
+
 void abFree(struct abuf *ab) {
     free(ab->b);
+    ab->b = NULL;
+    ab->len = ab->cap = 0;
 }
 
 /*** output ***/
@@ -487,7 +2798,7 @@ void abFree(struct abuf *ab) {
 void editorScroll() {
     E.rx = E.cx;
     if (E.cy < E.numrows) {
-        E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+        E.rx = editorRowCxToRx(editorRowAt(E.cy), E.cx);
     }
 
     if (E.cy < E.rowoff) {
@@ -504,9 +2815,154 @@ void editorScroll() {
     }
 }
 
-void editorDrawRows(struct abuf *ab) {
+/* Send line y of the frame if it isn't on the screen already. Lines of
+ * plain ASCII only have their changed span sent, others are sent whole. */
+void editorDrawLine(struct abuf *ab, int y, struct abuf *line) {
+    struct shadowLine *old = &E.shadow[y];
+    int plain = 1;
+    int j;
+    for (j = 0; j < line->len; j++) {
+        if (line->b[j] < ' ' || line->b[j] > '~') {
+            plain = 0;
+            break;
+        }
+    }
+
+    int start = 0;
+    int end = line->len;
+    while (start < line->len && start < old->len &&
+           line->b[start] == old->b[start])
+        start++;
+    if (start == line->len && start == old->len) return;
+    if (!plain) start = 0;
+    else if (line->len == old->len)
+        while (line->b[end - 1] == old->b[end - 1]) end--;
+
+    abAppendCursor(ab, y + 1, start + 1);
+    /* Clear before writing, so a full-width line keeps its last column */
+    if (!plain || line->len < old->len) abAppend(ab, "\x1b[K", 3);
+    abAppend(ab, &line->b[start], end - start);
+
+    if (line->len > old->cap) {
+        old->b = realloc(old->b, line->len);
+        old->cap = line->len;
+    }
+    if (line->len) memcpy(old->b, line->b, line->len);
+    old->len = line->len;
+}
+
+/* Scroll the text rows on the screen to where they are in the new frame,
+ * when they moved by less than a screenful, so they needn't be sent again.
+ * The first frame clears the screen instead. */
+void editorScrollFrame(struct abuf *ab) {
+    int y;
+    if (E.shadow == NULL) {
+        E.shadow = calloc(E.screenrows + 2, sizeof(struct shadowLine));
+        abAppend(ab, "\x1b[2J", 4);
+    } else if (E.coloff == E.shadowcoloff && E.rowoff != E.shadowrowoff &&
+               abs(E.rowoff - E.shadowrowoff) < E.screenrows) {
+        int d = E.rowoff - E.shadowrowoff;
+        int n = abs(d);
+        char buf[32];
+        snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r",
+                 E.screenrows, n, d > 0 ? 'S' : 'T');
+        abAppend(ab, buf, strlen(buf));
+
+        /* The lines scrolled off are reused as the blank ones scrolled in */
+        size_t gonesize = sizeof(struct shadowLine) * n;
+        struct shadowLine *gone = editorScratch(gonesize);
+        if (d > 0) {
+            memcpy(gone, E.shadow, gonesize);
+            memmove(E.shadow, &E.shadow[n],
+                    sizeof(struct shadowLine) * (E.screenrows - n));
+            memcpy(&E.shadow[E.screenrows - n], gone, gonesize);
+            for (y = E.screenrows - n; y < E.screenrows; y++)
+                E.shadow[y].len = 0;
+        } else {
+            memcpy(gone, &E.shadow[E.screenrows - n], gonesize);
+            memmove(&E.shadow[n], E.shadow,
+                    sizeof(struct shadowLine) * (E.screenrows - n));
+            memcpy(E.shadow, gone, gonesize);
+            for (y = 0; y < n; y++)
+                E.shadow[y].len = 0;
+        }
+    }
+    E.shadowrowoff = E.rowoff;
+    E.shadowcoloff = E.coloff;
+}
+
+/* Set mark for those of the len columns of render from from that are in a
+ * match of the search query, and clear it for the rest. */
+void editorMarkMatches(unsigned char *mark, char *render, int rsize,
+                       int from, int len) {
+    int qlen = strlen(E.query);
+    int end = from + len;
+    int limit = end + qlen - 1 < rsize ? end + qlen - 1 : rsize;
+    int scan = from - qlen + 1 > 0 ? from - qlen + 1 : 0;
+    char *m;
+
+    memset(mark, 0, len);
+    while (scan < limit &&
+           (m = memmem(&render[scan], limit - scan, E.query, qlen))) {
+        int start = m - render;
+        int stop = start + qlen < end ? start + qlen : end;
+        if (start < from) start = from;
+        memset(&mark[start - from], 1, stop - start);
+        scan = m - render + qlen;
+    }
+}
+
+/* Append len columns of render from from, in the colors of hl and with the
+ * columns set in mark in reverse video, either being NULL for none. An
+ * escape is only sent where the look changes, the chars up to the next
+ * change going in with one append. */
+void editorDrawColored(struct abuf *line, char *render, unsigned char *hl,
+                       unsigned char *mark, int from, int len) {
+    int color = 39, rev = 0;
+    int j = 0;
+    while (j < len) {
+        int c = hl ? editorSyntaxToColor(hl[from + j]) : 39;
+        int r = mark ? mark[j] : 0;
+        if (r != rev) {
+            if (r) abAppend(line, "\x1b[7m", 4);
+            else abAppend(line, "\x1b[27m", 5);
+            rev = r;
+        }
+        if (c != color) {
+            abAppend(line, "\x1b[", 2);
+            abAppendNum(line, c);
+            abAppend(line, "m", 1);
+            color = c;
+        }
+
+        int run = j + 1;
+        while (run < len &&
+               (hl ? editorSyntaxToColor(hl[from + run]) : 39) == color &&
+               (mark ? mark[run] : 0) == rev)
+            run++;
+        abAppend(line, &render[from + j], run - j);
+        j = run;
+    }
+    if (color != 39 || rev) abAppend(line, "\x1b[m", 3);
+}
+
+void editorDrawRows(struct abuf *ab, struct abuf *line) {
+    /* The rows are loaded first, so that the states they are highlighted
+     * from are brought up to date along with them */
+    erow **rows = editorScratch(sizeof(erow *) * E.screenrows);
+    erow *row = editorRowAt(E.rowoff);
     int y;
     for (y = 0; y < E.screenrows; y++) {
+        rows[y] = row;
+        if (row) row = editorRowNext(row);
+    }
+    if (E.syntax) editorHlSettle(E.rowoff + E.screenrows - 1, KILO_HL_FRAME);
+
+    unsigned char *mark = NULL;
+    if (E.query && E.query[0]) mark = editorScratch(E.screencols);
+    int state = 0;
+    for (y = 0; y < E.screenrows; y++) {
+        abReset(line);
         int filerow = y + E.rowoff;
         if (filerow >= E.numrows) {
             if (E.numrows == 0 && y == E.screenrows / 3) {
@@ -516,78 +2972,165 @@ void editorDrawRows(struct abuf *ab) {
                 if (welcomelen > E.screencols) welcomelen = E.screencols;
                 int padding = (E.screencols - welcomelen) / 2;
                 if (padding) {
-                    abAppend(ab, "~", 1);
+                    abAppend(line, "~", 1);
                     padding--;
                 }
-                while (padding--) abAppend(ab, " ", 1);
-                abAppend(ab, welcome, welcomelen);
+                abAppendRepeat(line, ' ', padding);
+                abAppend(line, welcome, welcomelen);
             } else {
-                abAppend(ab, "~", 1);
+                abAppend(line, "~", 1);
             }
         } else {
-            int len = E.row[filerow].rsize - E.coloff;
+            row = rows[y];
+            char *render = editorRowRender(row);
+            int len = row->rsize - E.coloff;
             if (len < 0) len = 0;
             if (len > E.screencols) len = E.screencols;
-            abAppend(ab, &E.row[filerow].render[E.coloff], len);
+
+            /* A row not lexed yet is taken to start where the one above
+             * ended, until idle time gets to it */
+            unsigned char *hl = NULL;
+            if (E.syntax) {
+                rownode *t = (rownode *)row;
+                if (t->hlin >= 0) state = t->hlin;
+                hl = editorRowHighlight(row, state);
+                state = row->hlopen;
+            }
+            if (mark)
+                editorMarkMatches(mark, render, row->rsize, E.coloff, len);
+            if (hl || mark)
+                editorDrawColored(line, render, hl, mark, E.coloff, len);
+            else
+                abAppend(line, &render[E.coloff], len);
         }
 
-        abAppend(ab, "\x1b[K", 3);
-        abAppend(ab, "\r\n", 2);
+        editorDrawLine(ab, y, line);
     }
 }
 
-void editorDrawStatusBar(struct abuf *ab) {
-    abAppend(ab, "\x1b[7m", 4);
+void editorDrawStatusBar(struct abuf *ab, struct abuf *line) {
+    abReset(line);
+    abAppend(line, "\x1b[7m", 4);
     char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
+    int len = snprintf(status, sizeof(status), "%.20s - %d%s lines %s",
         E.filename ? E.filename : "[No Name]", E.numrows,
-        E.dirty ? "(modified)" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d",
-        E.cy + 1, E.numrows);
+        E.loader ? "+" : "", E.dirty ? "(modified)" : "");
+    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
+        E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
     if (len > E.screencols) len = E.screencols;
-    abAppend(ab, status, len);
-    while (len < E.screencols) {
-        if (E.screencols - len == rlen) {
-            abAppend(ab, rstatus, rlen);
-            break;
-        } else {
-            abAppend(ab, " ", 1);
-            len++;
-        }
+    abAppend(line, status, len);
+    if (E.screencols - len >= rlen) {
+        abAppendRepeat(line, ' ', E.screencols - len - rlen);
+        abAppend(line, rstatus, rlen);
+    } else {
+        abAppendRepeat(line, ' ', E.screencols - len);
+    }
+    abAppend(line, "\x1b[m", 3);
+    editorDrawLine(ab, E.screenrows, line);
+}
+
+/* n with commas between the thousands, in buf. */
+char *editorFormatCount(char *buf, int n) {
+    char digits[16];
+    int len = snprintf(digits, sizeof(digits), "%d", n);
+    int i, j = 0;
+    for (i = 0; i < len; i++) {
+        if (i > 0 && (len - i) % 3 == 0) buf[j++] = ',';
+        buf[j++] = digits[i];
     }
-    abAppend(ab, "\x1b[m", 3);
-    abAppend(ab, "\r\n", 2);
+    buf[j] = '\0';
+    return buf;
+}
+
+/* How the search is going, as shown at the right of the message bar. */
+int editorSearchStatus(char *buf, int size) {
+    pthread_mutex_lock(&E.searchlock);
+    int numhits = E.numhits;
+    int hitrows = E.hitrows;
+    int done = E.searchdone;
+    pthread_mutex_unlock(&E.searchlock);
+
+    char hit[16], total[16], progress[16] = "";
+    if (!done && E.searchsnap.rows > 0)
+        snprintf(progress, sizeof(progress), " (%d%%)",
+                 (int)((long long)hitrows * 100 / E.searchsnap.rows));
+    if (numhits == 0)
+        return snprintf(buf, size, "%s%s", done ? "no matches" : "searching",
+                        progress);
+    return snprintf(buf, size, "match %s of %s%s",
+                    editorFormatCount(hit, E.hit + 1),
+                    editorFormatCount(total, numhits), progress);
+}
+
+/* What the last frame cost, how input is read, and the memory held by rows
+ * and renders, as the stats overlay shows them. */
+int editorStats(char *buf, int size) {
+    return snprintf(buf, size,
+                    "frame %lldus %dB | %.2f reads/key | rows %zuK "
+                    "renders %zuK",
+                    E.framens / 1000, E.framebytes,
+                    E.inkeys ? (double)E.inreads / E.inkeys : 0.0,
+                    E.rowbytes >> 10, E.renderbytes >> 10);
 }
 
-void editorDrawMessageBar(struct abuf *ab) {
-    abAppend(ab, "\x1b[K", 3);
+void editorDrawMessageBar(struct abuf *ab, struct abuf *line) {
+    abReset(line);
+    char stats[80];
+    char *msg = E.statusmsg;
     int msglen = strlen(E.statusmsg);
+    if (E.showstats) {
+        msg = stats;
+        msglen = editorStats(stats, sizeof(stats));
+        if (msglen >= (int)sizeof(stats)) msglen = sizeof(stats) - 1;
+    }
     if (msglen > E.screencols) msglen = E.screencols;
-    if (msglen && time(NULL) - E.statusmsg_time < 5)
-        abAppend(ab, E.statusmsg, msglen);
+    abAppend(line, msg, msglen);
+
+    if (E.query && E.query[0]) {
+        char status[80];
+        int len = editorSearchStatus(status, sizeof(status));
+        if (msglen + 1 + len <= E.screencols) {
+            abAppendRepeat(line, ' ', E.screencols - msglen - len);
+            abAppend(line, status, len);
+        }
+    }
+    editorDrawLine(ab, E.screenrows + 1, line);
+}
+
+/* A monotonic clock, in nanoseconds. */
+long long editorNanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
 void editorRefreshScreen() {
+    long long start = editorNanos();
+    editorScratchReset();
     editorScroll();
 
-    struct abuf ab = ABUF_INIT;
+    /* The frame and the line being drawn keep their memory between frames,
+     * so once they have grown to fit, drawing doesn't allocate. */
+    static struct abuf ab = ABUF_INIT;
+    static struct abuf line = ABUF_INIT;
+    abReset(&ab);
 
     abAppend(&ab, "\x1b[?25l", 6);
-    abAppend(&ab, "\x1b[H", 3);
 
-    editorDrawRows(&ab);
-    editorDrawStatusBar(&ab);
-    editorDrawMessageBar(&ab);
+    editorScrollFrame(&ab);
+    editorDrawRows(&ab, &line);
+    editorDrawStatusBar(&ab, &line);
+    editorDrawMessageBar(&ab, &line);
 
-    char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
-                                              (E.rx - E.coloff) + 1);
-    abAppend(&ab, buf, strlen(buf));
+    abAppendCursor(&ab, (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
 
     abAppend(&ab, "\x1b[?25h", 6);
 
+    E.framens = editorNanos() - start;
+    E.framebytes = ab.len;
     write(STDOUT_FILENO, ab.b, ab.len);
-    abFree(&ab);
+    E.idle = 1;
+    E.stale = 0;
 }
 
 void editorSetStatusMessage(const char *fmt, ...) {
@@ -595,7 +3138,165 @@ void editorSetStatusMessage(const char *fmt, ...) {
     va_start(ap, fmt);
     vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
     va_end(ap);
-    E.statusmsg_time = time(NULL);
+    editorTimerSet(TIMER_STATUS, KILO_STATUS_TIME * 1000, editorStatusExpire);
+}
+
+/*** events ***/
+
+/* Wake the event loop. Called from the other threads, and from the signal
+ * handler, so it only writes to the pipe. */
+void editorWake() {
+    char c = 0;
+    write(E.wakefd[1], &c, 1);
+}
+
+void editorHandleWinch(int sig) {
+    (void)sig;
+    winchanged = 1;
+    editorWake();
+}
+
+/* Take in a new window size. The next frame is drawn from scratch. */
+void editorResize() {
+    int y;
+    if (E.shadow) {
+        for (y = 0; y < E.screenrows + 2; y++) free(E.shadow[y].b);
+        free(E.shadow);
+        E.shadow = NULL;
+    }
+    editorUpdateWindowSize();
+}
+
+void editorTimerSet(int id, int ms, void (*fire)(void)) {
+    E.timers[id].at = editorNanos() + ms * 1000000LL;
+    E.timers[id].fire = fire;
+}
+
+/* Milliseconds until the next timer fires, or -1 if none is set. */
+int editorTimerTimeout() {
+    long long now = editorNanos();
+    int timeout = -1;
+    int id;
+    for (id = 0; id < TIMER_COUNT; id++) {
+        if (E.timers[id].at == 0) continue;
+        long long ms = (E.timers[id].at - now + 999999) / 1000000;
+        if (ms < 0) ms = 0;
+        if (timeout == -1 || ms < timeout) timeout = ms;
+    }
+    return timeout;
+}
+
+/* Fire the timers that are due. Returns whether any did. */
+int editorTimerRun() {
+    long long now = editorNanos();
+    int fired = 0;
+    int id;
+    for (id = 0; id < TIMER_COUNT; id++) {
+        if (E.timers[id].at == 0 || E.timers[id].at > now) continue;
+        E.timers[id].at = 0;
+        E.timers[id].fire();
+        fired = 1;
+    }
+    return fired;
+}
+
+void editorStatusExpire() {
+    E.statusmsg[0] = '\0';
+}
+
+/* Render the screenfuls of rows either side of the one shown, so that
+ * paging to them is drawn from the render cache. */
+int editorPrerender() {
+    int at = E.rowoff - E.screenrows;
+    if (at < 0) at = 0;
+    erow *row = editorRowAt(at);
+    for (; row && at < E.rowoff + 2 * E.screenrows; at++) {
+        editorRowRender(row);
+        row = editorRowNext(row);
+    }
+    return 0;
+}
+
+/* Bring the lexer states of the rows off the screen up to date, a slice at
+ * a time. */
+int editorHighlightIdle() {
+    if (E.syntax == NULL) return 0;
+    if (editorHlSettle(INT_MAX, KILO_HL_SLICE)) E.stale = 1;
+    return rowTreeFirstDirty() != NULL;
+}
+
+/* Work done while there is nothing else to, a slice at a time. Each task
+ * returns whether it has more to do, and sets E.stale if the screen has to
+ * be drawn again for it. */
+int (*editorIdleTasks[])(void) = {
+    editorPrerender,
+    editorHighlightIdle
+};
+
+#define IDLE_NUM_TASKS (int)(sizeof(editorIdleTasks) / sizeof(editorIdleTasks[0]))
+
+int editorIdle() {
+    int more = 0;
+    int k;
+    for (k = 0; k < IDLE_NUM_TASKS; k++)
+        if (editorIdleTasks[k]()) more = 1;
+    return more;
+}
+
+/* Read what input there is into inbuf. Returns whether there was any. */
+int editorInputRead() {
+    int nread = read(STDIN_FILENO, E.inbuf, sizeof(E.inbuf));
+    if (nread == -1 && errno != EAGAIN && errno != EINTR) die("read");
+    if (nread <= 0) return 0;
+    E.inpos = 0;
+    E.inlen = nread;
+    E.inreads++;
+    return 1;
+}
+
+/* Wait until there is input, in poll() on the terminal and the wake pipe.
+ * What the other threads did, resizes and timers are taken in as they come,
+ * with one frame for all that happened at once, and idle work is done when
+ * there is nothing else. With none left, the editor sleeps until woken. */
+void editorInputWait() {
+    while (E.inpos == E.inlen) {
+        struct pollfd fds[2];
+        fds[0].fd = STDIN_FILENO;
+        fds[0].events = POLLIN;
+        fds[1].fd = E.wakefd[0];
+        fds[1].events = POLLIN;
+        int n = poll(fds, 2, E.idle ? 0 : editorTimerTimeout());
+        if (n == -1) {
+            if (errno != EINTR) die("poll");
+            fds[0].revents = fds[1].revents = 0;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            char buf[64];
+            while (read(E.wakefd[0], buf, sizeof(buf)) > 0);
+        }
+        int changed = editorIndexPoll();
+        if (editorSearchPoll()) changed = 1;
+        if (editorSavePoll()) changed = 1;
+        if (editorTimerRun()) changed = 1;
+        if (winchanged) {
+            winchanged = 0;
+            editorResize();
+            changed = 1;
+        }
+
+        /* The keys are drawn along with the rest */
+        if ((fds[0].revents & (POLLIN | POLLHUP | POLLERR)) &&
+            editorInputRead())
+            break;
+
+        if (changed) {
+            editorRefreshScreen();
+        } else if (n == 0 && E.idle) {
+            E.idle = editorIdle();
+            if (E.stale) editorRefreshScreen();
+        }
+    }
 }
 
 /*** input ***/
@@ -609,7 +3310,9 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 
     while (1) {
         editorSetStatusMessage(prompt, buf);
-        editorRefreshScreen();
+        /* The prompt stays up for as long as it is being answered */
+        E.timers[TIMER_STATUS].at = 0;
+        if (!editorInputPending()) editorRefreshScreen();
 
         int c = editorReadKey();
         if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
@@ -638,8 +3341,50 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
     }
 }
 
+/* Read the text of a bracketed paste, up to the sequence that ends it, and
+ * insert it all at once. The input is taken a read at a time rather than
+ * decoded key by key, and straight from the terminal, so that no timer
+ * fires and no frame is drawn before the paste is all in. */
+void editorPaste() {
+    static const char endseq[] = "\x1b[201~";
+    int seqlen = sizeof(endseq) - 1;
+    struct abuf paste = ABUF_INIT;
+
+    while (1) {
+        while (E.inpos == E.inlen) {
+            struct pollfd fd;
+            fd.fd = STDIN_FILENO;
+            fd.events = POLLIN;
+            if (poll(&fd, 1, -1) == -1 && errno != EINTR) die("poll");
+            editorInputRead();
+        }
+        int from = paste.len > seqlen - 1 ? paste.len - (seqlen - 1) : 0;
+        abAppend(&paste, &E.inbuf[E.inpos], E.inlen - E.inpos);
+        E.inpos = E.inlen;
+
+        char *m = memmem(&paste.b[from], paste.len - from, endseq, seqlen);
+        if (m) {
+            /* Keys after the paste are left to be read */
+            E.inpos -= paste.b + paste.len - (m + seqlen);
+            paste.len = m - paste.b;
+            break;
+        }
+    }
+
+    /* Lines of a paste end in '\r' or "\r\n" as often as in '\n' */
+    int i, j = 0;
+    for (i = 0; i < paste.len; i++) {
+        if (paste.b[i] != '\r') paste.b[j++] = paste.b[i];
+        else if (i + 1 == paste.len || paste.b[i + 1] != '\n') paste.b[j++] = '\n';
+    }
+    paste.len = j;
+
+    if (paste.len > 0) editorInsertText(paste.b, paste.len);
+    abFree(&paste);
+}
+
 void editorMoveCursor(int key) {
-    erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    erow *row = editorRowAt(E.cy);
 
     switch (key) {
         case ARROW_LEFT:
@@ -647,7 +3392,7 @@ void editorMoveCursor(int key) {
                 E.cx--;
             } else if (E.cy > 0) {
                 E.cy--;
-                E.cx = E.row[E.cy].size;
+                E.cx = editorRowAt(E.cy)->size;
             }
             break;
         case ARROW_RIGHT:
@@ -670,7 +3415,7 @@ void editorMoveCursor(int key) {
             break;
     }
 
-    row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    row = editorRowAt(E.cy);
     int rowlen = row ? row->size : 0;
     if (E.cx > rowlen) {
         E.cx = rowlen;
@@ -679,6 +3424,7 @@ void editorMoveCursor(int key) {
 
 void editorProcessKeypress() {
     static int quit_times = KILO_QUIT_TIMES;
+    int typing = 0;
 
     int c = editorReadKey();
 
@@ -694,6 +3440,7 @@ void editorProcessKeypress() {
                 quit_times--;
                 return;
             }
+            editorSaveWait();
             write(STDOUT_FILENO, "\x1b[2J", 4);
             write(STDOUT_FILENO, "\x1b[H", 3);
             exit(0);
@@ -709,7 +3456,7 @@ void editorProcessKeypress() {
 
         case END_KEY:
             if (E.cy < E.numrows)
-                E.cx = E.row[E.cy].size;
+                E.cx = editorRowAt(E.cy)->size;
             break;
 
         case CTRL_KEY('f'):
@@ -721,6 +3468,7 @@ void editorProcessKeypress() {
         case DEL_KEY:
             if (c == DEL_KEY) editorMoveCursor(ARROW_RIGHT);
             editorDelChar();
+            typing = 1;
             break;
 
         case PAGE_UP:
@@ -746,18 +3494,160 @@ void editorProcessKeypress() {
             editorMoveCursor(c);
             break;
         
+        case PASTE_START:
+            editorPaste();
+            break;
+
+        case CTRL_KEY('z'):
+            editorUndo();
+            break;
+
+        case CTRL_KEY('y'):
+            editorRedo();
+            break;
+
+        case CTRL_KEY('t'):
+            E.showstats = !E.showstats;
+            break;
+
         case CTRL_KEY('l'):
         case '\x1b':
+        case PASTE_END:
             break;
 
         default:
             editorInsertChar(c);
+            typing = 1;
             break;
     }
 
+    /* Only a run of typing, or of deleting, is undone as one */
+    if (!typing) editorUndoSeal();
     quit_times = KILO_QUIT_TIMES;
 }
 
+/*** bench ***/
+
+/* Keys replayed by the benchmark, over and over: typing, moving around,
+ * deleting, scrolling a page at a time and undoing. */
+static const char *benchKeys[] = {
+    "h", "e", "l", "l", "o", " ", "\r", "\x1b[B", "\x1b[B", "\x7f", "\x7f",
+    "\x1b[6~", "\x1b[C", "\x1b[C", "\t", "w", "o", "r", "l", "d", "\x1b[F",
+    "\r", "\x1b[5~", "\x1b[A", "\x1b[H", "\x1b[3~", "\x1a", "\x19"
+};
+
+#define BENCH_NUM_KEYS (int)(sizeof(benchKeys) / sizeof(benchKeys[0]))
+
+int benchCompare(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+/* Write a file of about mb megabytes of lines of words, some with tabs, and
+ * some keywords, numbers, strings and comments to be highlighted. Returns
+ * its size. */
+size_t benchMakeFile(FILE *fp, int mb) {
+    static const char *words[] = {
+        "the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog",
+        "\t", "editor", "row", "render", "search", "kilo", "int", "return",
+        "42", "\"str\"", "/*", "*/"
+    };
+    int numwords = sizeof(words) / sizeof(words[0]);
+    long long bytes = 0;
+    int line = 0;
+
+    srand(1);
+    while (bytes < (long long)mb << 20) {
+        bytes += fprintf(fp, "%d:", line++);
+        int n = rand() % 16;
+        while (n--) bytes += fprintf(fp, " %s", words[rand() % numwords]);
+        fputc('\n', fp);
+        bytes++;
+    }
+    return bytes;
+}
+
+void benchReport(FILE *out, const char *what, size_t bytes, long long ns) {
+    double s = ns / 1e9;
+    fprintf(out, "%s: %.1f MB in %.3f s (%.1f MB/s)\n", what,
+            bytes / 1048576.0, s, s > 0 ? bytes / 1048576.0 / s : 0.0);
+}
+
+/* Run without a terminal on a made-up file of mb megabytes: time opening
+ * and highlighting it, replaying KILO_BENCH_KEYS keys through
+ * editorProcessKeypress(), each followed by a frame, searching and saving.
+ * Frames go to /dev/null, the results to stdout. */
+int editorBench(int mb) {
+    char path[] = "/tmp/kilo-bench-XXXXXX.c";
+    int fd = mkstemps(path, 2);
+    if (fd == -1) die("mkstemps");
+    FILE *fp = fdopen(fd, "w");
+    size_t size = benchMakeFile(fp, mb);
+    fclose(fp);
+
+    FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+    int null = open("/dev/null", O_WRONLY);
+    if (null == -1 || dup2(null, STDOUT_FILENO) == -1) die("/dev/null");
+    close(null);
+    E.screenrows = 24 - 2;
+    E.screencols = 80;
+
+    fprintf(out, "allocator: %s\n", E.alloc->name);
+    long long start = editorNanos();
+    editorOpen(path);
+    editorIndexWait(INT_MAX);
+    benchReport(out, "open", size, editorNanos() - start);
+
+    /* All of it, as idle time would get to after opening */
+    start = editorNanos();
+    while (editorHighlightIdle());
+    benchReport(out, "highlight", size, editorNanos() - start);
+
+    long long *lat = malloc(sizeof(long long) * KILO_BENCH_KEYS);
+    int k;
+    editorRefreshScreen();
+    for (k = 0; k < KILO_BENCH_KEYS; k++) {
+        const char *key = benchKeys[k % BENCH_NUM_KEYS];
+        E.inlen = strlen(key);
+        memcpy(E.inbuf, key, E.inlen);
+        E.inpos = 0;
+
+        start = editorNanos();
+        editorProcessKeypress();
+        editorRefreshScreen();
+        lat[k] = editorNanos() - start;
+    }
+    qsort(lat, KILO_BENCH_KEYS, sizeof(long long), benchCompare);
+    fprintf(out, "keys: %d, latency p50 %lld us, p90 %lld us, "
+            "p99 %lld us, max %lld us\n", KILO_BENCH_KEYS,
+            lat[KILO_BENCH_KEYS / 2] / 1000,
+            lat[KILO_BENCH_KEYS * 9 / 10] / 1000,
+            lat[KILO_BENCH_KEYS * 99 / 100] / 1000,
+            lat[KILO_BENCH_KEYS - 1] / 1000);
+    free(lat);
+
+    /* A query that is nowhere, so every row is searched */
+    start = editorNanos();
+    editorSearchStart("kilo bench");
+    pthread_mutex_lock(&E.searchlock);
+    while (!E.searchdone) pthread_cond_wait(&E.searchcond, &E.searchlock);
+    pthread_mutex_unlock(&E.searchlock);
+    benchReport(out, "search", size, editorNanos() - start);
+    editorSearchStop();
+
+    start = editorNanos();
+    editorSave();
+    editorSaveWait();
+    if (E.saveerrno == 0)
+        benchReport(out, "save", E.savebytes, editorNanos() - start);
+    else
+        fprintf(out, "save: %s\n", strerror(E.saveerrno));
+
+    unlink(path);
+    fclose(out);
+    return 0;
+}
+
 /*** init ***/
 
 void initEditor() {
@@ -767,28 +3657,83 @@ void initEditor() {
     E.rowoff = 0;
     E.coloff = 0;
     E.numrows = 0;
-    E.row = NULL;
+    E.rows = NULL;
+    editorPickAllocator();
+    E.map = NULL;
+    E.loader = NULL;
+    E.lruhead = E.lrutail = NULL;
+    E.renderbytes = 0;
+    E.syntax = NULL;
+    E.hlblock = NULL;
+    E.hlspan.node = NULL;
+    E.stale = 0;
+    E.rowbytes = 0;
+    E.shadow = NULL;
+    E.scratch = NULL;
+    E.scratchlen = E.scratchcap = E.scratchneed = 0;
+    E.scratchextra = NULL;
+    E.query = NULL;
+    E.hits = NULL;
+    E.numhits = E.hitcap = 0;
+    E.hit = -1;
+    E.seenhits = E.seenrows = 0;
+    E.searching = 0;
+    pthread_mutex_init(&E.searchlock, NULL);
+    pthread_cond_init(&E.searchcond, NULL);
+    E.saving = 0;
+    pthread_mutex_init(&E.savelock, NULL);
+    E.inpos = E.inlen = 0;
+    E.showstats = 0;
+    if (pipe(E.wakefd) == -1) die("pipe");
+    fcntl(E.wakefd[0], F_SETFL, O_NONBLOCK);
+    fcntl(E.wakefd[1], F_SETFL, O_NONBLOCK);
+    memset(E.timers, 0, sizeof(E.timers));
+    E.idle = 0;
+    E.framens = 0;
+    E.framebytes = 0;
+    E.inreads = E.inkeys = 0;
+    E.undo = NULL;
+    E.undofirst = E.undonext = E.undoend = E.undocap = 0;
+    E.undotext = NULL;
+    E.undobase = E.undolen = E.undotextcap = 0;
+    E.undoseal = 1;
+    E.undoing = 0;
+    char *undomax = getenv("KILO_UNDO_MAX");
+    E.undomax = undomax ? strtoull(undomax, NULL, 10) : KILO_UNDO_MAX;
     E.dirty = 0;
     E.filename = NULL;
     E.statusmsg[0] = '\0';
-    E.statusmsg_time = 0;
+}
 
+void editorUpdateWindowSize() {
     if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
     E.screenrows -= 2;
 }
 
 int main(int argc, char *argv[]) {
-    enableRawMode();
     initEditor();
+    if (argc >= 2 && strcmp(argv[1], "--bench") == 0)
+        return editorBench(argc >= 3 ? atoi(argv[2]) : KILO_BENCH_MB);
+
+    enableRawMode();
+    editorUpdateWindowSize();
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = editorHandleWinch;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGWINCH, &sa, NULL);
     if (argc >= 2) {
         editorOpen(argv[1]);
     }
 
     editorSetStatusMessage(
-        "HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+        "HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | "
+        "Ctrl-Z/Y = undo/redo | Ctrl-T = stats");
 
+    /* Keys that came in together are all processed before the next frame */
     while (1) {
-        editorRefreshScreen();
+        if (!editorInputPending()) editorRefreshScreen();
         editorProcessKeypress();
     }
 